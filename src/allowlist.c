@@ -0,0 +1,311 @@
+/*
+ *   Allowlist.
+ *   Immutable set of requesters that are never rate limited:
+ *   a minimal perfect hash of exact keys plus a table of CIDR networks
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "allowlist.h"
+
+// give up searching a displacement seed after this many attempts
+#define MAX_DISPLACEMENT 65536
+// number of build attempts, each one with more buckets
+#define MAX_BUILD_ROUNDS 4
+
+// bucket size, used to place the largest buckets first
+struct __bucketOrder {
+  unsigned int id;
+  unsigned int size;
+};
+
+// seeded FNV-1a with a final avalanche, so that "% n" spreads well
+static uint64_t hash_key(const char *key, uint32_t seed) {
+  uint64_t h = 14695981039346656037ULL ^ ((uint64_t)seed * 0x9E3779B97F4A7C15ULL);
+
+  while (*key) {
+    h ^= (unsigned char)*key++;
+    h *= 1099511628211ULL;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// qsort comparators
+static int compare_keys(const void *a, const void *b) {
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int compare_bucket_size(const void *a, const void *b) {
+  const struct __bucketOrder *ba = (const struct __bucketOrder *)a;
+  const struct __bucketOrder *bb = (const struct __bucketOrder *)b;
+
+  return (int)bb->size - (int)ba->size;
+}
+
+// parse "address/prefix"
+static int parse_network(const char *entry, cidrEntry *network) {
+  char address[64];
+  const char *slash = strchr(entry, '/');
+  size_t len = slash - entry;
+  unsigned int maxPrefix;
+  unsigned long prefix;
+  char *end;
+
+  if (len >= sizeof(address))
+    return -1;
+  memcpy(address, entry, len);
+  address[len] = '\0';
+
+  bzero(network, sizeof(cidrEntry));
+  if (inet_pton(AF_INET, address, network->address) == 1) {
+    network->family = AF_INET;
+    maxPrefix = 32;
+  } else if (inet_pton(AF_INET6, address, network->address) == 1) {
+    network->family = AF_INET6;
+    maxPrefix = 128;
+  } else return -1;
+
+  // a typo must not turn into /0 (every address) or be silently clamped
+  if (!isdigit((unsigned char)slash[1]))
+    return -1;
+  errno = 0;
+  prefix = strtoul(slash + 1, &end, 10);
+  if (errno != 0 || *end != '\0' || prefix > maxPrefix)
+    return -1;
+  network->prefixLength = prefix;
+
+  return 0;
+}
+
+// compare the first prefixLength bits of two addresses
+static int match_prefix(const unsigned char *a, const unsigned char *b, unsigned int prefixLength) {
+  unsigned int bytes = prefixLength / 8;
+  unsigned int bits = prefixLength % 8;
+
+  if (memcmp(a, b, bytes) != 0)
+    return 0;
+  if (bits == 0)
+    return 1;
+  return ((a[bytes] ^ b[bytes]) & (0xff << (8 - bits))) == 0;
+}
+
+// place every key in its own slot (hash and displace).
+// buckets are processed largest first; for each one we look for a seed that
+// sends all of its keys to free, distinct slots.
+static int build_perfect_hash(allowlist *list, char **keys, unsigned int n, unsigned int m) {
+  struct __bucketOrder *order = NULL;
+  unsigned int *bucketOf = NULL, *start = NULL, *members = NULL, *fill = NULL, *slots = NULL;
+  unsigned char *used = NULL;
+  unsigned int i, j, k, maxSize = 0, freeSlot = 0;
+  int ret = -1;
+
+  list->keys = (char **)calloc(n, sizeof(char *));
+  list->displacement = (uint32_t *)calloc(m, sizeof(uint32_t));
+  order = (struct __bucketOrder *)calloc(m, sizeof(struct __bucketOrder));
+  bucketOf = (unsigned int *)malloc(n * sizeof(unsigned int));
+  start = (unsigned int *)calloc(m + 1, sizeof(unsigned int));
+  members = (unsigned int *)malloc(n * sizeof(unsigned int));
+  fill = (unsigned int *)calloc(m, sizeof(unsigned int));
+  slots = (unsigned int *)malloc(n * sizeof(unsigned int));
+  used = (unsigned char *)calloc(n, sizeof(unsigned char));
+  if (!list->keys || !list->displacement || !order || !bucketOf || !start || !members || !fill || !slots || !used)
+    goto out;
+
+  list->keyCount = n;
+  list->bucketCount = m;
+
+  // group keys by bucket
+  for (i = 0; i < n; i++) {
+    bucketOf[i] = hash_key(keys[i], 0) % m;
+    start[bucketOf[i] + 1]++;
+  }
+  for (i = 0; i < m; i++) {
+    order[i].id = i;
+    order[i].size = start[i + 1];
+    start[i + 1] += start[i];
+  }
+  for (i = 0; i < n; i++)
+    members[start[bucketOf[i]] + fill[bucketOf[i]]++] = i;
+  qsort(order, m, sizeof(struct __bucketOrder), compare_bucket_size);
+
+  for (i = 0; i < m && order[i].size > 0; i++) {
+    unsigned int b = order[i].id;
+    uint32_t seed;
+
+    if (order[i].size > maxSize)
+      maxSize = order[i].size;
+
+    // singletons come last and take the remaining slots directly:
+    // searching a seed that hits one of the few free slots left is hopeless
+    if (order[i].size == 1) {
+      while (used[freeSlot])
+        freeSlot++;
+      used[freeSlot] = 1;
+      list->displacement[b] = DIRECT_SLOT | freeSlot;
+      list->keys[freeSlot] = keys[members[start[b]]];
+      continue;
+    }
+
+    for (seed = 1; seed < MAX_DISPLACEMENT; seed++) {
+      // try the seed, marking slots as we go
+      for (j = 0; j < order[i].size; j++) {
+        slots[j] = hash_key(keys[members[start[b] + j]], seed) % n;
+        if (used[slots[j]])
+          break;
+        used[slots[j]] = 1;
+      }
+      if (j == order[i].size)
+        break;
+
+      // collision: roll back
+      for (k = 0; k < j; k++)
+        used[slots[k]] = 0;
+    }
+
+    if (seed == MAX_DISPLACEMENT) {
+      #ifdef DEBUG_ALLOWLIST
+        printf("build_perfect_hash(): no displacement found for bucket %d (%d keys)\n", b, order[i].size);
+      #endif
+      goto out;
+    }
+
+    list->displacement[b] = seed;
+    for (j = 0; j < order[i].size; j++)
+      list->keys[slots[j]] = keys[members[start[b] + j]];
+  }
+
+  #ifdef DEBUG_ALLOWLIST
+    printf("build_perfect_hash(): %d keys in %d buckets, largest bucket %d\n", n, m, maxSize);
+  #endif
+  ret = 0;
+
+out:
+  if (ret != 0) {
+    free(list->keys);
+    free(list->displacement);
+    list->keys = NULL;
+    list->displacement = NULL;
+    list->keyCount = 0;
+    list->bucketCount = 0;
+  }
+  free(order);
+  free(bucketOf);
+  free(start);
+  free(members);
+  free(fill);
+  free(slots);
+  free(used);
+  return ret;
+}
+
+// compile entries
+int buildAllowlist(allowlist *list, char **entries, unsigned int count) {
+  char **exact;
+  unsigned int i, n = 0, unique = 0, round, buckets;
+  int ret = 0;
+
+  bzero(list, sizeof(allowlist));
+  if (count == 0)
+    return 0;
+
+  exact = (char **)malloc(count * sizeof(char *));
+  list->networks = (cidrEntry *)calloc(count, sizeof(cidrEntry));
+  if (exact == NULL || list->networks == NULL) {
+    free(exact);
+    freeAllowlist(list);
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (strchr(entries[i], '/') != NULL) {
+      if (parse_network(entries[i], &list->networks[list->networkCount]) == 0)
+        list->networkCount++;
+      #ifdef DEBUG_ALLOWLIST
+      else
+        printf("buildAllowlist(): ignoring invalid network %s\n", entries[i]);
+      #endif
+    } else {
+      exact[n] = strdup(entries[i]);
+      if (exact[n] != NULL)
+        n++;
+    }
+  }
+
+  // a perfect hash needs distinct keys
+  qsort(exact, n, sizeof(char *), compare_keys);
+  for (i = 0; i < n; i++) {
+    if (unique > 0 && strcmp(exact[unique - 1], exact[i]) == 0)
+      free(exact[i]);
+    else
+      exact[unique++] = exact[i];
+  }
+
+  if (unique > 0) {
+    // start with ~4 keys per bucket, double the buckets on failure
+    buckets = (unique >> 2) + 1;
+    ret = -1;
+    for (round = 0; round < MAX_BUILD_ROUNDS && ret != 0; round++, buckets *= 2)
+      ret = build_perfect_hash(list, exact, unique, buckets);
+    if (ret != 0) {
+      for (i = 0; i < unique; i++)
+        free(exact[i]);
+    }
+  }
+
+  free(exact);
+  return ret;
+}
+
+// lookup
+int matchAllowlist(const allowlist *list, const char *requester) {
+  unsigned char address[16];
+  unsigned int i;
+  int family;
+
+  if (list->keyCount > 0) {
+    uint32_t seed = list->displacement[hash_key(requester, 0) % list->bucketCount];
+    const char *candidate;
+
+    if (seed & DIRECT_SLOT)
+      candidate = list->keys[seed & ~DIRECT_SLOT];
+    else
+      candidate = list->keys[hash_key(requester, seed) % list->keyCount];
+    if (candidate != NULL && strcmp(candidate, requester) == 0)
+      return 1;
+  }
+
+  if (list->networkCount > 0) {
+    if (inet_pton(AF_INET, requester, address) == 1)
+      family = AF_INET;
+    else if (inet_pton(AF_INET6, requester, address) == 1)
+      family = AF_INET6;
+    else return 0;
+
+    for (i = 0; i < list->networkCount; i++) {
+      if (list->networks[i].family == family && match_prefix(address, list->networks[i].address, list->networks[i].prefixLength))
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+// release memory
+void freeAllowlist(allowlist *list) {
+  unsigned int i;
+
+  if (list->keys != NULL) {
+    for (i = 0; i < list->keyCount; i++)
+      free(list->keys[i]);
+  }
+  free(list->keys);
+  free(list->displacement);
+  free(list->networks);
+  bzero(list, sizeof(allowlist));
+}
@@ -0,0 +1,58 @@
+/*
+ *   Allowlist.
+ *   Immutable set of requesters that are never rate limited:
+ *   a minimal perfect hash of exact keys plus a table of CIDR networks
+ */
+
+// libc includes
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef DEBUG_ALLOWLIST
+  #include <stdio.h>
+#endif
+
+// displacement flag: the value is the slot of a single-key bucket
+#define DIRECT_SLOT 0x80000000U
+
+// a network in CIDR notation
+struct __cidrEntry {
+  int family;
+  unsigned char address[16];
+  unsigned int prefixLength;
+};
+
+typedef struct __cidrEntry cidrEntry;
+
+/*
+ *  The compiled allowlist.
+ *  An exact key hashes to a bucket, the bucket displacement seed then
+ *  selects exactly one slot in keys[] (single-key buckets store the slot
+ *  directly): a lookup is at most two hashes and one strcmp.
+ */
+struct __allowlist {
+  // slot -> key
+  char **keys;
+  unsigned int keyCount;
+  // bucket -> displacement seed
+  uint32_t *displacement;
+  unsigned int bucketCount;
+  // networks
+  cidrEntry *networks;
+  unsigned int networkCount;
+};
+
+typedef struct __allowlist allowlist;
+
+/*
+ * Function prototypes.
+ */
+
+// compile entries (exact keys and "address/prefix" networks) into the allowlist
+int buildAllowlist(allowlist *list, char **entries, unsigned int count);
+
+// return non zero if requester is exempt from rate limiting
+int matchAllowlist(const allowlist *list, const char *requester);
+
+// release allowlist memory
+void freeAllowlist(allowlist *list);
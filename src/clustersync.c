@@ -0,0 +1,386 @@
+/*
+ *   Cluster Sync.
+ *   Exchanges batched per-bucket consumption deltas between Varnish nodes
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include <cache/cache.h>
+#include "vtim.h"
+#include "clustersync.h"
+#include "wireformat.h"
+
+// a resolved peer address
+struct __syncPeer {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+};
+
+typedef struct __syncPeer syncPeer;
+
+// sync thread state
+static int sync_socket = -1;
+static syncPeer *sync_peers = NULL;
+static unsigned int sync_peer_count = 0;
+static unsigned int sync_interval = SYNC_DEFAULT_INTERVAL;
+static sync_collect_fn sync_collect = NULL;
+static sync_merge_fn sync_merge = NULL;
+static volatile int sync_running = 0;
+static pthread_t sync_thread;
+
+// monotonic clock in msec, used to schedule flushes
+static double mono_msec(void) {
+  struct timespec ts;
+
+  AZ(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return ((double)ts.tv_sec * 1e3 + (double)ts.tv_nsec * 1e-6);
+}
+
+// resolve a "host:port" (or "[v6addr]:port") string
+static int resolve_address(const char *address, syncPeer *peer) {
+  struct addrinfo hints, *res = NULL;
+  char host[256];
+  const char *port;
+  size_t hostlen;
+
+  port = strrchr(address, ':');
+  if (port == NULL)
+    return -1;
+
+  hostlen = port - address;
+  if (hostlen >= sizeof(host))
+    return -1;
+  memcpy(host, address, hostlen);
+  host[hostlen] = '\0';
+  port++;
+
+  // strip brackets around IPv6 literals
+  if (hostlen > 1 && host[0] == '[' && host[hostlen - 1] == ']') {
+    host[hostlen - 1] = '\0';
+    memmove(host, host + 1, hostlen - 1);
+  }
+
+  bzero(&hints, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, port, &hints, &res) != 0 || res == NULL)
+    return -1;
+
+  memcpy(&peer->addr, res->ai_addr, res->ai_addrlen);
+  peer->addrlen = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  return 0;
+}
+
+// compare two socket addresses (family, address and port)
+static int same_address(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+  if (a->ss_family != b->ss_family)
+    return FALSE;
+
+  if (a->ss_family == AF_INET) {
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+    const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+    return (a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+  } else if (a->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+    return (a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0);
+  }
+
+  return FALSE;
+}
+
+// true for INADDR_ANY / in6addr_any
+static int wildcard_address(const struct sockaddr_storage *a) {
+  if (a->ss_family == AF_INET)
+    return (((const struct sockaddr_in *)a)->sin_addr.s_addr == htonl(INADDR_ANY));
+  if (a->ss_family == AF_INET6)
+    return (memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr, &in6addr_any, sizeof(struct in6_addr)) == 0);
+
+  return FALSE;
+}
+
+// port of a socket address
+static in_port_t address_port(const struct sockaddr_storage *a) {
+  if (a->ss_family == AF_INET)
+    return ((const struct sockaddr_in *)a)->sin_port;
+  if (a->ss_family == AF_INET6)
+    return ((const struct sockaddr_in6 *)a)->sin6_port;
+
+  return 0;
+}
+
+// true if address is assigned to this host: binding it (on any port) works
+static int local_address(const syncPeer *peer) {
+  struct sockaddr_storage probe;
+  int fd, ret;
+
+  memcpy(&probe, &peer->addr, sizeof(probe));
+  if (probe.ss_family == AF_INET)
+    ((struct sockaddr_in *)&probe)->sin_port = 0;
+  else if (probe.ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)&probe)->sin6_port = 0;
+  else
+    return FALSE;
+
+  fd = socket(probe.ss_family, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return FALSE;
+  ret = (bind(fd, (struct sockaddr *)&probe, peer->addrlen) == 0);
+  close(fd);
+
+  return ret;
+}
+
+// true if peer is this node: its own address, or any local address on
+// the listen port when listening on a wildcard address
+static int own_address(const syncPeer *peer, const syncPeer *local) {
+  if (same_address(&peer->addr, &local->addr))
+    return TRUE;
+
+  return (wildcard_address(&local->addr) && address_port(&peer->addr) == address_port(&local->addr) && local_address(peer));
+}
+
+// send a datagram to every peer
+static void send_datagram(const unsigned char *buf, size_t len) {
+  unsigned int i;
+
+  for (i = 0; i < sync_peer_count; i++) {
+    if (sendto(sync_socket, buf, len, 0, (const struct sockaddr *)&sync_peers[i].addr, sync_peers[i].addrlen) < 0) {
+      #ifdef DEBUG_CLUSTERSYNC
+        printf("clustersync.c: send_datagram(): sendto() to peer %d failed (errno %d)\n", i, errno);
+      #endif
+    }
+  }
+}
+
+// collect local deltas and ship them to peers in batches
+static void flush_deltas(void) {
+  unsigned char buf[SYNC_MAX_DATAGRAM];
+  syncRecord *records = NULL;
+  unsigned int count, sent, batch, i;
+  uint32_t magic = htonl(SYNC_MAGIC);
+  uint16_t n;
+
+  count = sync_collect(&records);
+  #ifdef DEBUG_CLUSTERSYNC
+    printf("clustersync.c: flush_deltas(): %d pending deltas\n", count);
+  #endif
+
+  for (sent = 0; sent < count; sent += batch) {
+    unsigned char *p = buf + SYNC_HEADER_LEN;
+
+    batch = count - sent;
+    if (batch > SYNC_MAX_RECORDS)
+      batch = SYNC_MAX_RECORDS;
+
+    // header: magic, version, reserved, record count
+    memcpy(buf, &magic, sizeof(magic));
+    buf[4] = SYNC_VERSION;
+    buf[5] = 0;
+    n = htons((uint16_t)batch);
+    memcpy(buf + 6, &n, sizeof(n));
+
+    for (i = 0; i < batch; i++) {
+      const syncRecord *r = &records[sent + i];
+      memcpy(p, r->digest, DIGEST_LEN);
+      putDouble(p + DIGEST_LEN, r->delta);
+      putFloat(p + DIGEST_LEN + 8, r->ratio);
+      putFloat(p + DIGEST_LEN + 12, r->capacity);
+      p += SYNC_RECORD_LEN;
+    }
+
+    send_datagram(buf, p - buf);
+  }
+
+  free(records);
+}
+
+// decode a datagram and merge its records
+static void receive_deltas(void) {
+  unsigned char buf[SYNC_MAX_DATAGRAM];
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  syncRecord r;
+  uint32_t magic;
+  uint16_t n;
+  ssize_t len;
+  unsigned int i, known;
+  double now;
+
+  for (;;) {
+    fromlen = sizeof(from);
+    len = recvfrom(sync_socket, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+    if (len < 0)
+      return;
+
+    // only accept datagrams from configured peers
+    known = FALSE;
+    for (i = 0; i < sync_peer_count && !known; i++)
+      known = same_address(&from, &sync_peers[i].addr);
+    if (!known || len < SYNC_HEADER_LEN)
+      continue;
+
+    memcpy(&magic, buf, sizeof(magic));
+    memcpy(&n, buf + 6, sizeof(n));
+    n = ntohs(n);
+    if (ntohl(magic) != SYNC_MAGIC || buf[4] != SYNC_VERSION || len != SYNC_HEADER_LEN + n * SYNC_RECORD_LEN) {
+      #ifdef DEBUG_CLUSTERSYNC
+        printf("clustersync.c: receive_deltas(): dropping malformed datagram (%d bytes)\n", (int)len);
+      #endif
+      continue;
+    }
+
+    now = VTIM_real();
+    for (i = 0; i < n; i++) {
+      const unsigned char *p = buf + SYNC_HEADER_LEN + i * SYNC_RECORD_LEN;
+      memcpy(r.digest, p, DIGEST_LEN);
+      r.delta = getDouble(p + DIGEST_LEN);
+      r.ratio = getFloat(p + DIGEST_LEN + 8);
+      r.capacity = getFloat(p + DIGEST_LEN + 12);
+
+      // source addresses are easy to spoof: a record that would turn tokens
+      // into NaN or hand out tokens is dropped
+      if (!isfinite(r.delta) || r.delta < 0 || !isfinite(r.ratio) || r.ratio <= 0 || !isfinite(r.capacity) || r.capacity <= 0) {
+        #ifdef DEBUG_CLUSTERSYNC
+          printf("clustersync.c: receive_deltas(): dropping invalid record\n");
+        #endif
+        continue;
+      }
+      sync_merge(&r, now);
+    }
+  }
+}
+
+// sync thread main loop
+static void *sync_loop(void *arg) {
+  struct pollfd pfd;
+  double next_flush, now;
+  int timeout;
+  (void) arg;
+
+  pfd.fd = sync_socket;
+  pfd.events = POLLIN;
+  next_flush = mono_msec() + sync_interval;
+
+  while (sync_running) {
+    now = mono_msec();
+    timeout = (next_flush > now) ? (int)(next_flush - now) + 1 : 0;
+
+    if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN))
+      receive_deltas();
+
+    if (mono_msec() >= next_flush) {
+      flush_deltas();
+      next_flush = mono_msec() + sync_interval;
+    }
+  }
+
+  // ship whatever is left before leaving
+  flush_deltas();
+  return (NULL);
+}
+
+// resolve peers, bind the local socket and start the sync thread
+int startClusterSync(const char *listenAddress, char **peers, unsigned int peerCount, unsigned int interval, sync_collect_fn collect, sync_merge_fn merge) {
+  syncPeer local;
+  unsigned int i, self = peerCount;
+  int bound = FALSE;
+
+  if (sync_running || peerCount == 0)
+    return -1;
+
+  sync_peers = (syncPeer *)calloc(peerCount, sizeof(syncPeer));
+  if (sync_peers == NULL)
+    return -1;
+
+  // explicit listen address
+  if (listenAddress != NULL) {
+    if (resolve_address(listenAddress, &local) == 0) {
+      sync_socket = socket(local.addr.ss_family, SOCK_DGRAM, 0);
+      if (sync_socket >= 0 && bind(sync_socket, (struct sockaddr *)&local.addr, local.addrlen) == 0)
+        bound = TRUE;
+    }
+  }
+
+  sync_peer_count = 0;
+  for (i = 0; i < peerCount; i++) {
+    syncPeer *peer = &sync_peers[sync_peer_count];
+
+    if (resolve_address(peers[i], peer) != 0) {
+      #ifdef DEBUG_CLUSTERSYNC
+        printf("clustersync.c: startClusterSync(): cannot resolve peer %s\n", peers[i]);
+      #endif
+      continue;
+    }
+
+    // without an explicit listen address the first peer address we can
+    // bind is our own: the same peer list works for every node, also
+    // for several varnishd instances on loopback
+    if (!bound && listenAddress == NULL) {
+      if (sync_socket < 0)
+        sync_socket = socket(peer->addr.ss_family, SOCK_DGRAM, 0);
+      if (sync_socket >= 0 && bind(sync_socket, (struct sockaddr *)&peer->addr, peer->addrlen) == 0) {
+        bound = TRUE;
+        self = i;
+        continue;
+      }
+    } else if (bound && listenAddress != NULL && own_address(peer, &local)) {
+      continue;
+    }
+
+    sync_peer_count++;
+  }
+
+  if (!bound || sync_peer_count == 0) {
+    #ifdef DEBUG_CLUSTERSYNC
+      printf("clustersync.c: startClusterSync(): no local address or no peers, sync disabled\n");
+    #endif
+    stopClusterSync();
+    return -1;
+  }
+
+  #ifdef DEBUG_CLUSTERSYNC
+    printf("clustersync.c: startClusterSync(): bound local socket (peer #%d), syncing with %d peers\n", self, sync_peer_count);
+  #endif
+  (void) self;
+
+  sync_interval = interval > 0 ? interval : SYNC_DEFAULT_INTERVAL;
+  sync_collect = collect;
+  sync_merge = merge;
+  sync_running = TRUE;
+  if (pthread_create(&sync_thread, NULL, sync_loop, NULL) != 0) {
+    sync_running = FALSE;
+    stopClusterSync();
+    return -1;
+  }
+
+  return 0;
+}
+
+// stop the sync thread and close the socket
+void stopClusterSync(void) {
+  if (sync_running) {
+    sync_running = FALSE;
+    AZ(pthread_join(sync_thread, NULL));
+  }
+
+  if (sync_socket >= 0) {
+    close(sync_socket);
+    sync_socket = -1;
+  }
+
+  free(sync_peers);
+  sync_peers = NULL;
+  sync_peer_count = 0;
+}
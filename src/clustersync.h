@@ -0,0 +1,59 @@
+/*
+ *   Cluster Sync.
+ *   Exchanges batched per-bucket consumption deltas between Varnish nodes
+ */
+
+// libc includes
+#include <stdlib.h>
+#include <string.h>
+#ifdef DEBUG_CLUSTERSYNC
+  #include <stdio.h>
+#endif
+
+// DIGEST_LEN comes from varnish's cache/cache.h, include it first
+
+#ifndef TRUE
+  #define TRUE   1
+  #define FALSE  0
+#endif
+
+// wire format
+#define SYNC_MAGIC        0x434c4d44   /* "CLMD" */
+#define SYNC_VERSION      2
+#define SYNC_HEADER_LEN   8
+#define SYNC_RECORD_LEN   (DIGEST_LEN + 16)
+#define SYNC_MAX_DATAGRAM 1400
+#define SYNC_MAX_RECORDS  ((SYNC_MAX_DATAGRAM - SYNC_HEADER_LEN) / SYNC_RECORD_LEN)
+
+// default flush interval (msec)
+#define SYNC_DEFAULT_INTERVAL 100
+
+/*
+ *  A sync record.
+ *  Tokens consumed on one bucket since the last flush, plus the
+ *  bucket parameters needed by peers that do not know the bucket yet.
+ */
+struct __syncRecord {
+  unsigned char digest[DIGEST_LEN];
+  double delta;
+  double ratio;
+  double capacity;
+};
+
+typedef struct __syncRecord syncRecord;
+
+// collect pending local deltas. returns the number of records stored in *records (caller frees)
+typedef unsigned int (*sync_collect_fn)(syncRecord **records);
+
+// merge a delta received from a peer into the local buckets
+typedef void (*sync_merge_fn)(const syncRecord *record, double now);
+
+/*
+ * Function prototypes.
+ */
+
+// resolve peers, bind the local socket and start the sync thread
+int startClusterSync(const char *listenAddress, char **peers, unsigned int peerCount, unsigned int interval, sync_collect_fn collect, sync_merge_fn merge);
+
+// stop the sync thread and close the socket
+void stopClusterSync(void);
@@ -0,0 +1,136 @@
+/*
+ *   Heavy Hitters.
+ *   Bounded top-K tracking of the busiest buckets (Space-Saving algorithm)
+ */
+
+#include "heavyhitters.h"
+
+// digest fingerprint, used to match entries without storing the whole digest
+static uint64_t fingerprint(const unsigned char *digest) {
+  uint64_t fp;
+
+  memcpy(&fp, digest, sizeof(fp));
+  return fp;
+}
+
+// store "requester resource", truncated to the label size.
+// bounded copies only: this runs under the partition lock every time a new key
+// enters a full table, which is most decisions when keys are many
+static void set_label(char *label, const char *requester, const char *resource) {
+  size_t n, m;
+
+  n = strnlen(requester, HH_LABEL_LEN - 1);
+  memcpy(label, requester, n);
+  if (n < HH_LABEL_LEN - 1) {
+    label[n++] = ' ';
+    m = strnlen(resource, HH_LABEL_LEN - 1 - n);
+    memcpy(label + n, resource, m);
+    n += m;
+  }
+  label[n] = '\0';
+}
+
+// allocate table
+int initHeavyHitters(hhTable *table, unsigned int size) {
+  table->entries = NULL;
+  table->size = 0;
+  table->used = 0;
+
+  if (size == 0)
+    return 0;
+
+  table->entries = (hhEntry *)calloc(size, sizeof(hhEntry));
+  if (table->entries == NULL)
+    return -1;
+
+  #ifdef DEBUG_HEAVYHITTERS
+    printf("%s: 0x%X (%d entries)\n","initHeavyHitters(): Table allocated at", table->entries, size);
+  #endif
+
+  table->size = size;
+  return 0;
+}
+
+// release table
+void freeHeavyHitters(hhTable *table) {
+  free(table->entries);
+  table->entries = NULL;
+  table->size = 0;
+  table->used = 0;
+}
+
+// account a decision.
+// a known key is simply incremented; a new key takes a free slot or replaces
+// the entry with the lowest count, inheriting that count as its error bound.
+void updateHeavyHitters(hhTable *table, const unsigned char *digest, const char *requester, const char *resource, unsigned int denied) {
+  uint64_t fp;
+  hhEntry *e, *min = NULL;
+  unsigned int i;
+
+  if (table->size == 0)
+    return;
+
+  fp = fingerprint(digest);
+  for (i = 0; i < table->used; i++) {
+    e = &table->entries[i];
+    if (e->fingerprint == fp) {
+      e->requests++;
+      e->denies += denied;
+      return;
+    }
+    if (min == NULL || e->requests < min->requests)
+      min = e;
+  }
+
+  if (table->used < table->size) {
+    e = &table->entries[table->used++];
+    e->error = 0;
+    e->requests = 1;
+  } else {
+    #ifdef DEBUG_HEAVYHITTERS
+      printf("updateHeavyHitters(): evicting %s (%ju requests)\n", min->label, (uintmax_t)min->requests);
+    #endif
+    e = min;
+    e->error = e->requests;
+    e->requests++;
+  }
+
+  e->fingerprint = fp;
+  e->denies = denied;
+  set_label(e->label, requester, resource);
+}
+
+// copy entries out of the table
+unsigned int snapshotHeavyHitters(const hhTable *table, hhEntry *out) {
+  if (table->used > 0)
+    memcpy(out, table->entries, table->used * sizeof(hhEntry));
+  return table->used;
+}
+
+// move selected entries, used when a partition is split
+void splitHeavyHitters(hhTable *from, hhTable *to, int (*moves)(uint64_t fingerprint, void *arg), void *arg) {
+  unsigned int i, kept = 0;
+
+  for (i = 0; i < from->used; i++) {
+    if (moves(from->entries[i].fingerprint, arg) && to->used < to->size)
+      to->entries[to->used++] = from->entries[i];
+    else
+      from->entries[kept++] = from->entries[i];
+  }
+  from->used = kept;
+}
+
+// qsort comparator: descending request count
+static int compare_requests(const void *a, const void *b) {
+  const hhEntry *ea = (const hhEntry *)a;
+  const hhEntry *eb = (const hhEntry *)b;
+
+  if (ea->requests == eb->requests)
+    return 0;
+  return (ea->requests < eb->requests) ? 1 : -1;
+}
+
+// sort entries
+void sortHeavyHitters(hhEntry *entries, unsigned int count) {
+  qsort(entries, count, sizeof(hhEntry), compare_requests);
+}
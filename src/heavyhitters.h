@@ -0,0 +1,63 @@
+/*
+ *   Heavy Hitters.
+ *   Bounded top-K tracking of the busiest buckets (Space-Saving algorithm)
+ */
+
+// libc includes
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef DEBUG_HEAVYHITTERS
+  #include <stdio.h>
+#endif
+
+// default number of tracked keys per partition
+#define HH_DEFAULT_SIZE  16
+// length of the stored "requester resource" label
+#define HH_LABEL_LEN     96
+
+/*
+ *  A tracked key.
+ *  requests is an upper bound of the real count, overestimated by at most error.
+ */
+struct __hhEntry {
+  // first 8 bytes of the bucket digest
+  uint64_t fingerprint;
+  uint64_t requests;
+  uint64_t denies;
+  uint64_t error;
+  char label[HH_LABEL_LEN];
+};
+
+typedef struct __hhEntry hhEntry;
+
+// per-partition table, protected by the partition mutex
+struct __hhTable {
+  hhEntry *entries;
+  unsigned int size;
+  unsigned int used;
+};
+
+typedef struct __hhTable hhTable;
+
+/*
+ * Function prototypes.
+ */
+
+// allocate a table tracking at most size keys (size 0 disables tracking)
+int initHeavyHitters(hhTable *table, unsigned int size);
+
+// release table memory
+void freeHeavyHitters(hhTable *table);
+
+// account a decision for the bucket identified by digest
+void updateHeavyHitters(hhTable *table, const unsigned char *digest, const char *requester, const char *resource, unsigned int denied);
+
+// copy the tracked entries to out (room for table->size entries), returns the number of entries copied
+unsigned int snapshotHeavyHitters(const hhTable *table, hhEntry *out);
+
+// move the entries selected by moves() (called with each entry fingerprint) from a table to another
+void splitHeavyHitters(hhTable *from, hhTable *to, int (*moves)(uint64_t fingerprint, void *arg), void *arg);
+
+// sort entries by request count, busiest first
+void sortHeavyHitters(hhEntry *entries, unsigned int count);
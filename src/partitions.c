@@ -0,0 +1,349 @@
+/*
+ *   Bucket Partitions.
+ *   Lock-striped bucket lists addressed through an extendible hash directory.
+ *   Partitions that see lock contention are split in two automatically.
+ */
+
+#include <unistd.h>
+
+#include "tokenbucket.h"
+#include "vtim.h"
+#include "heavyhitters.h"
+#include "partitions.h"
+
+// every partition ever created, indexed by creation order (never shrinks)
+static bucketList **registry = NULL;
+static unsigned int registry_count = 0;
+static unsigned int max_depth = 0;
+
+// current directory, replaced (never modified) when it has to change
+static bucketDirectory *directory = NULL;
+
+// serializes splits
+static pthread_mutex_t split_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// partition selector: the first PARTITION_PREFIX_LEN digest bytes
+static uint32_t digest_selector(const unsigned char *digest) {
+  return ((uint32_t)digest[0] << 24 | (uint32_t)digest[1] << 16 | (uint32_t)digest[2] << 8 | (uint32_t)digest[3]);
+}
+
+// mask selecting the low `depth` bits.
+//
+// X % Y (where y is a power of 2) is equivalent to: X & (Y-1)
+//
+// Take Y=32 for example (which is 2^5) and Y-1=31
+// 32 dec == 00100000 bin
+// 31 dec == 00011111 bin
+//
+// so, any multiple of a number like Y=2^N must end with N bits set as 0
+// the remainder of a division by Y=2^N is the same number with all bits discarded except for
+// the last N
+static uint32_t depth_mask(unsigned int depth) {
+  return (depth >= 32) ? 0xffffffff : ((1U << depth) - 1);
+}
+
+// allocate a partition owning selectors whose low `depth` bits equal `bits`
+static bucketList *new_partition(unsigned int depth, uint32_t bits, unsigned int topkSize) {
+  bucketList *v = (bucketList *)calloc(1, sizeof(bucketList));
+
+  if (v == NULL)
+    return NULL;
+
+  AZ(pthread_mutex_init(&v->list_mutex, NULL));
+  v->listHead = NULL;
+  v->gc_count = 0;
+  v->depth = depth;
+  v->bits = bits;
+  initHeavyHitters(&v->topk, topkSize);
+
+  return v;
+}
+
+// allocate a directory with 2^globalDepth slots
+static bucketDirectory *new_directory(unsigned int globalDepth) {
+  bucketDirectory *d = (bucketDirectory *)calloc(1, sizeof(bucketDirectory));
+
+  if (d == NULL)
+    return NULL;
+
+  d->globalDepth = globalDepth;
+  d->slots = (bucketList **)calloc((size_t)1 << globalDepth, sizeof(bucketList *));
+  if (d->slots == NULL) {
+    free(d);
+    return NULL;
+  }
+
+  return d;
+}
+
+// publish a new partition in the registry
+static void register_partition(bucketList *v) {
+  registry[registry_count] = v;
+  __atomic_store_n(&registry_count, registry_count + 1, __ATOMIC_RELEASE);
+}
+
+// heavy hitters entries follow their keys to the new partition
+static int hh_moves(uint64_t fingerprint, void *arg) {
+  const bucketList *to = (const bucketList *)arg;
+  unsigned char prefix[sizeof(fingerprint)];
+
+  memcpy(prefix, &fingerprint, sizeof(fingerprint));
+  return ((digest_selector(prefix) & depth_mask(to->depth)) == to->bits);
+}
+
+// split a contended partition in two. called with v locked.
+// the new partition takes the buckets whose next selector bit is set; it is fully
+// populated before any directory slot points to it, and v->depth is bumped last, so a
+// thread that looked up v in the directory fails the ownership check in
+// lockPartition() once it gets the lock, and retries.
+// slots are updated in place while the directory is deep enough; it is only copied
+// (and the old one retired) when it has to double
+static void split_partition(bucketList *v) {
+  bucketDirectory *old, *nd = NULL;
+  bucketList *sibling;
+  bucket *b, *next;
+  unsigned int depth = v->depth, globalDepth;
+  size_t i, slots;
+
+  AZ(pthread_mutex_lock(&split_mutex));
+  old = directory;
+
+  if (depth >= max_depth || registry_count >= MAX_PARTITIONS) {
+    AZ(pthread_mutex_unlock(&split_mutex));
+    return;
+  }
+
+  sibling = new_partition(depth + 1, v->bits | (1U << depth), v->topk.size);
+  globalDepth = (depth == old->globalDepth) ? old->globalDepth + 1 : old->globalDepth;
+  if (sibling != NULL && globalDepth != old->globalDepth)
+    nd = new_directory(globalDepth);
+  if (sibling == NULL || (globalDepth != old->globalDepth && nd == NULL)) {
+    if (sibling != NULL) {
+      freeHeavyHitters(&sibling->topk);
+      AZ(pthread_mutex_destroy(&sibling->list_mutex));
+      free(sibling);
+    }
+    AZ(pthread_mutex_unlock(&split_mutex));
+    return;
+  }
+
+  // move buckets (parents and children share their selector, they move together)
+  for (b = v->listHead; b != NULL; b = next) {
+    next = b->nextBucket;
+    if ((digest_selector(b->objectDigest) & depth_mask(depth + 1)) != sibling->bits)
+      continue;
+
+    if (b->prevBucket != NULL)
+      b->prevBucket->nextBucket = next;
+    else
+      v->listHead = next;
+    if (next != NULL)
+      next->prevBucket = b->prevBucket;
+
+    b->prevBucket = NULL;
+    b->nextBucket = sibling->listHead;
+    if (sibling->listHead != NULL)
+      sibling->listHead->prevBucket = b;
+    sibling->listHead = b;
+    v->buckets--;
+    sibling->buckets++;
+  }
+  // and their place on the dirty list
+  for (b = v->dirtyHead, v->dirtyHead = NULL; b != NULL; b = next) {
+    next = b->nextDirty;
+    if ((digest_selector(b->objectDigest) & depth_mask(depth + 1)) == sibling->bits) {
+      b->nextDirty = sibling->dirtyHead;
+      sibling->dirtyHead = b;
+    } else {
+      b->nextDirty = v->dirtyHead;
+      v->dirtyHead = b;
+    }
+  }
+  splitHeavyHitters(&v->topk, &sibling->topk, hh_moves, sibling);
+  v->generation++;
+
+  register_partition(sibling);
+  slots = (size_t)1 << globalDepth;
+  if (nd != NULL) {
+    // doubled directory: copy, point the sibling's slots to it, then publish
+    for (i = 0; i < slots; i++) {
+      nd->slots[i] = old->slots[i & depth_mask(old->globalDepth)];
+      if ((i & depth_mask(depth + 1)) == sibling->bits)
+        nd->slots[i] = sibling;
+    }
+    nd->previous = old;
+    __atomic_store_n(&directory, nd, __ATOMIC_RELEASE);
+  } else {
+    // same depth: a reader sees either v (and retries) or the sibling
+    for (i = sibling->bits; i < slots; i += (size_t)1 << (depth + 1))
+      __atomic_store_n(&old->slots[i], sibling, __ATOMIC_RELEASE);
+  }
+  v->depth = depth + 1;
+
+  #ifdef DEBUG_PARTITIONS
+    printf("partitions.c: split_partition(): split depth %d bits 0x%X, %d partitions, directory depth %d\n", depth, v->bits, registry_count, globalDepth);
+  #endif
+
+  AZ(pthread_mutex_unlock(&split_mutex));
+}
+
+// allocate the initial partitions
+int initPartitions(unsigned int initial, unsigned int topkSize) {
+  unsigned int depth = 0, p;
+  long cpus;
+
+  // initial must be a power of 2
+  while (((1U << depth) < initial) && ((1U << depth) < MAX_PARTITIONS))
+    depth++;
+
+  // let the partitions grow up to PARTITIONS_PER_CPU per online CPU
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1)
+    cpus = 1;
+  max_depth = depth;
+  while (((1UL << max_depth) < (unsigned long)cpus * PARTITIONS_PER_CPU) && ((1U << max_depth) < MAX_PARTITIONS))
+    max_depth++;
+
+  registry = (bucketList **)calloc(MAX_PARTITIONS, sizeof(bucketList *));
+  directory = new_directory(depth);
+  if (registry == NULL || directory == NULL) {
+    freePartitions();
+    return -1;
+  }
+
+  for (p = 0; p < (1U << depth); p++) {
+    bucketList *v = new_partition(depth, p, topkSize);
+    if (v == NULL) {
+      freePartitions();
+      return -1;
+    }
+    #ifdef DEBUG_PARTITIONS
+      printf("partitions.c: initPartitions(): Allocating Bucket Queue Slice %d...\n", p);
+    #endif
+    directory->slots[p] = v;
+    register_partition(v);
+  }
+
+  return 0;
+}
+
+// free everything
+void freePartitions(void) {
+  bucketDirectory *d, *previous;
+  unsigned int p;
+
+  for (p = 0; p < registry_count; p++) {
+    bucketList *v = registry[p];
+    #ifdef DEBUG_PARTITIONS
+      printf("partitions.c: freePartitions(): Freeing Bucket Queue address 0x%X...\n", v->listHead);
+    #endif
+    if (v->listHead != NULL)
+      freeBucketQueue(v->listHead);
+    freeHeavyHitters(&v->topk);
+    AZ(pthread_mutex_destroy(&v->list_mutex));
+    free(v);
+  }
+
+  for (d = directory; d != NULL; d = previous) {
+    previous = d->previous;
+    free(d->slots);
+    free(d);
+  }
+
+  free(registry);
+  registry = NULL;
+  registry_count = 0;
+  directory = NULL;
+}
+
+// number of partitions
+unsigned int partitionCount(void) {
+  return __atomic_load_n(&registry_count, __ATOMIC_ACQUIRE);
+}
+
+// partition by index
+bucketList *getPartition(unsigned int index) {
+  return registry[index];
+}
+
+// lock the owner of digest.
+// a failed trylock counts as contention, and the time spent waiting is measured.
+bucketList *lockPartition(const unsigned char *digest) {
+  uint32_t selector = digest_selector(digest);
+  bucketDirectory *d;
+  bucketList *v;
+  double t0;
+
+  for (;;) {
+    d = __atomic_load_n(&directory, __ATOMIC_ACQUIRE);
+    v = __atomic_load_n(&d->slots[selector & depth_mask(d->globalDepth)], __ATOMIC_ACQUIRE);
+
+    if (pthread_mutex_trylock(&v->list_mutex) != 0) {
+      t0 = VTIM_mono();
+      AZ(pthread_mutex_lock(&v->list_mutex));
+      v->contended++;
+      v->waited += VTIM_mono() - t0;
+    }
+    v->acquisitions++;
+
+    // v may have been split while we were waiting
+    if ((selector & depth_mask(v->depth)) == v->bits)
+      return v;
+
+    AZ(pthread_mutex_unlock(&v->list_mutex));
+  }
+}
+
+// ownership test, for callers walking digests in partition order
+int ownsDigest(const bucketList *v, const unsigned char *digest) {
+  return ((digest_selector(digest) & depth_mask(v->depth)) == v->bits);
+}
+
+// pre-split before a bulk load, instead of waiting for contention.
+// every round splits each partition once
+void growPartitions(unsigned int target) {
+  unsigned int count, p, depth = 0;
+
+  if (target > MAX_PARTITIONS)
+    target = MAX_PARTITIONS;
+
+  // short lists matter more than the per-CPU limit once a large state is loaded
+  while ((1U << depth) < target)
+    depth++;
+  AZ(pthread_mutex_lock(&split_mutex));
+  if (depth > max_depth)
+    max_depth = depth;
+  AZ(pthread_mutex_unlock(&split_mutex));
+
+  while ((count = partitionCount()) < target) {
+    for (p = 0; p < count; p++) {
+      bucketList *v = registry[p];
+
+      AZ(pthread_mutex_lock(&v->list_mutex));
+      split_partition(v);
+      AZ(pthread_mutex_unlock(&v->list_mutex));
+    }
+
+    // no partition could be split
+    if (partitionCount() == count)
+      break;
+  }
+
+  #ifdef DEBUG_PARTITIONS
+    printf("partitions.c: growPartitions(): %d partitions for a target of %d\n", partitionCount(), target);
+  #endif
+}
+
+// unlock, evaluating contention at the end of every window
+void unlockPartition(bucketList *v) {
+  if (v->acquisitions >= SPLIT_WINDOW) {
+    if ((v->contended * SPLIT_CONTENDED_RATIO > v->acquisitions) || (v->waited > SPLIT_WAIT_THRESHOLD))
+      split_partition(v);
+
+    v->acquisitions = 0;
+    v->contended = 0;
+    v->waited = 0;
+  }
+
+  AZ(pthread_mutex_unlock(&v->list_mutex));
+}
@@ -0,0 +1,97 @@
+/*
+ *   Bucket Partitions.
+ *   Lock-striped bucket lists addressed through an extendible hash directory.
+ *   Partitions that see lock contention are split in two automatically.
+ */
+
+// libc includes
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifdef DEBUG_PARTITIONS
+  #include <stdio.h>
+#endif
+
+// bucket and hhTable come from tokenbucket.h and heavyhitters.h, include them first
+
+// digest bytes used to select a partition
+#define PARTITION_PREFIX_LEN 4
+// hard limit on the number of partitions
+#define MAX_PARTITIONS 65536
+// partitions created per online CPU before splitting stops
+#define PARTITIONS_PER_CPU 16
+// contention is evaluated every SPLIT_WINDOW lock acquisitions...
+#define SPLIT_WINDOW 4096
+// ...and a partition is split when more than 1/SPLIT_CONTENDED_RATIO of them had to wait
+#define SPLIT_CONTENDED_RATIO 16
+// ...or when the total wait exceeded SPLIT_WAIT_THRESHOLD seconds
+#define SPLIT_WAIT_THRESHOLD 0.005
+
+// bucket list struct
+struct __bucketList {
+  pthread_mutex_t list_mutex;
+  bucket *listHead;
+  int gc_count;
+  // busiest keys seen by this partition
+  hhTable topk;
+  // this list owns every digest whose low `depth` selector bits equal `bits`
+  unsigned int depth;
+  uint32_t bits;
+  // contention statistics for the current window
+  unsigned int acquisitions;
+  unsigned int contended;
+  double waited;
+  // counters: live buckets and decisions
+  unsigned int buckets;
+  uint64_t allowed;
+  uint64_t denied;
+  // buckets with a syncDelta to send, linked by nextDirty
+  bucket *dirtyHead;
+  // session cache lookups answered by / missed in this list
+  uint64_t sessionHits;
+  uint64_t sessionMisses;
+  // bumped whenever buckets are freed or moved out of this list:
+  // a bucket pointer cached outside the lock is valid while it is unchanged
+  uint64_t generation;
+};
+
+typedef struct __bucketList bucketList;
+
+// extendible hash directory: 2^globalDepth slots pointing to partitions
+struct __bucketDirectory {
+  unsigned int globalDepth;
+  bucketList **slots;
+  // retired directories, freed with the partitions
+  struct __bucketDirectory *previous;
+};
+
+typedef struct __bucketDirectory bucketDirectory;
+
+/*
+ * Function prototypes.
+ */
+
+// allocate the initial partitions (a power of 2) and the directory
+int initPartitions(unsigned int initial, unsigned int topkSize);
+
+// free all partitions, their buckets and the directories
+void freePartitions(void);
+
+// number of partitions currently allocated
+unsigned int partitionCount(void);
+
+// partition by index (0 <= index < partitionCount()), for walks over every partition
+bucketList *getPartition(unsigned int index);
+
+// lock and return the partition that owns digest
+bucketList *lockPartition(const unsigned char *digest);
+
+// unlock a partition returned by lockPartition(), splitting it first if it is contended
+void unlockPartition(bucketList *v);
+
+// return non zero if the locked partition v owns digest
+int ownsDigest(const bucketList *v, const unsigned char *digest);
+
+// split partitions until there are at least target of them (up to MAX_PARTITIONS,
+// regardless of PARTITIONS_PER_CPU: this is for bulk loads, not contention)
+void growPartitions(unsigned int target);
@@ -0,0 +1,111 @@
+/*
+ *   Session Cache.
+ *   Direct-mapped table remembering the last bucket used by each client session:
+ *   repeated decisions on a keep-alive or HTTP/2 connection skip hashing and lookup
+ */
+
+#include "tokenbucket.h"
+#include "heavyhitters.h"
+#include "partitions.h"
+#include "sessioncache.h"
+
+static sessionSlot *slots = NULL;
+static unsigned int slot_mask = 0;
+
+// slot index: session structs come from a pool, mix the address bits
+static unsigned int slot_index(const void *session, uint32_t vxid) {
+  uint64_t h = ((uint64_t)(uintptr_t)session ^ vxid) * 0x9E3779B97F4A7C15ULL;
+
+  return (unsigned int)(h >> 32) & slot_mask;
+}
+
+// allocate the slots
+int initSessionCache(unsigned int size) {
+  unsigned int n = 1, i;
+
+  if (size == 0)
+    return 0;
+
+  while (n < size && n < 0x80000000U)
+    n <<= 1;
+
+  slots = (sessionSlot *)calloc(n, sizeof(sessionSlot));
+  if (slots == NULL)
+    return -1;
+
+  for (i = 0; i < n; i++)
+    AZ(pthread_mutex_init(&slots[i].slot_mutex, NULL));
+  slot_mask = n - 1;
+
+  #ifdef DEBUG_SESSIONCACHE
+    printf("sessioncache.c: initSessionCache(): %d slots\n", n);
+  #endif
+
+  return 0;
+}
+
+// release the slots
+void freeSessionCache(void) {
+  unsigned int i;
+
+  if (slots == NULL)
+    return;
+
+  for (i = 0; i <= slot_mask; i++)
+    AZ(pthread_mutex_destroy(&slots[i].slot_mutex));
+  free(slots);
+  slots = NULL;
+  slot_mask = 0;
+}
+
+// trylock: concurrent requests of the same session (HTTP/2 streams), or of
+// sessions sharing the slot, take the uncached path instead of waiting
+sessionSlot *lockSessionSlot(const void *session, uint32_t vxid) {
+  sessionSlot *slot;
+
+  if (slots == NULL || session == NULL)
+    return NULL;
+
+  slot = &slots[slot_index(session, vxid)];
+  if (pthread_mutex_trylock(&slot->slot_mutex) != 0)
+    return NULL;
+
+  return slot;
+}
+
+// validate the cached handle.
+// the slot lock is taken before the partition lock, never the other way round
+bucket *lookupSessionSlot(sessionSlot *slot, const void *session, uint32_t vxid, bucketList **partition) {
+  bucketList *v;
+
+  if (slot->item == NULL || slot->session != session || slot->vxid != vxid)
+    return NULL;
+
+  v = lockPartition(slot->digest);
+  if (v != slot->partition || v->generation != slot->generation) {
+    #ifdef DEBUG_SESSIONCACHE
+      printf("sessioncache.c: lookupSessionSlot(): stale handle 0x%X\n", slot->item);
+    #endif
+    unlockPartition(v);
+    slot->item = NULL;
+    return NULL;
+  }
+
+  *partition = v;
+  return slot->item;
+}
+
+// remember a bucket
+void storeSessionSlot(sessionSlot *slot, const void *session, uint32_t vxid, bucket *item, bucketList *partition) {
+  slot->session = session;
+  slot->vxid = vxid;
+  memcpy(slot->digest, item->objectDigest, DIGEST_LEN);
+  slot->item = item;
+  slot->partition = partition;
+  slot->generation = partition->generation;
+}
+
+// unlock
+void unlockSessionSlot(sessionSlot *slot) {
+  AZ(pthread_mutex_unlock(&slot->slot_mutex));
+}
@@ -0,0 +1,57 @@
+/*
+ *   Session Cache.
+ *   Direct-mapped table remembering the last bucket used by each client session:
+ *   repeated decisions on a keep-alive or HTTP/2 connection skip hashing and lookup
+ */
+
+// libc includes
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifdef DEBUG_SESSIONCACHE
+  #include <stdio.h>
+#endif
+
+// bucket and bucketList come from tokenbucket.h and partitions.h, include them first
+
+/*
+ *  A cached handle.
+ *  item is not pinned: it is only dereferenced with its partition locked and
+ *  the partition generation unchanged, which proves it was neither freed nor moved.
+ */
+struct __sessionSlot {
+  pthread_mutex_t slot_mutex;
+  // owner session: address and vxid (session structs are recycled)
+  const void *session;
+  uint32_t vxid;
+  // digest of the cached bucket, selects the partition to lock
+  unsigned char digest[DIGEST_LEN];
+  bucket *item;
+  bucketList *partition;
+  uint64_t generation;
+};
+
+typedef struct __sessionSlot sessionSlot;
+
+/*
+ * Function prototypes.
+ */
+
+// allocate size slots (rounded up to a power of 2, 0 disables the cache)
+int initSessionCache(unsigned int size);
+
+// release the slots
+void freeSessionCache(void);
+
+// lock and return the slot of a session, NULL if the cache is disabled or the slot is busy
+sessionSlot *lockSessionSlot(const void *session, uint32_t vxid);
+
+// return the cached bucket if it belongs to this session and is still valid.
+// on success the partition is locked and returned in *partition
+bucket *lookupSessionSlot(sessionSlot *slot, const void *session, uint32_t vxid, bucketList **partition);
+
+// remember item, found in partition (locked), for this session
+void storeSessionSlot(sessionSlot *slot, const void *session, uint32_t vxid, bucket *item, bucketList *partition);
+
+// unlock a slot returned by lockSessionSlot()
+void unlockSessionSlot(sessionSlot *slot);
@@ -0,0 +1,137 @@
+/*
+ *   Snapshot.
+ *   Binary dump of the live buckets, to carry the limiter state over to another node
+ */
+
+#include <arpa/inet.h>
+
+#include <cache/cache.h>
+#include "snapshot.h"
+#include "wireformat.h"
+
+// records written per fwrite()
+#define SNAPSHOT_CHUNK 128
+
+// create the file and write the header: magic, version, 3 reserved bytes
+FILE *createSnapshot(const char *path) {
+  unsigned char header[SNAPSHOT_HEADER_LEN];
+  uint32_t magic = htonl(SNAPSHOT_MAGIC);
+  FILE *handle;
+
+  handle = fopen(path, "wb");
+  if (handle == NULL)
+    return NULL;
+
+  bzero(header, sizeof(header));
+  memcpy(header, &magic, sizeof(magic));
+  header[4] = SNAPSHOT_VERSION;
+  if (fwrite(header, sizeof(header), 1, handle) != 1) {
+    fclose(handle);
+    return NULL;
+  }
+
+  return handle;
+}
+
+// encode and append records
+int writeSnapshot(FILE *handle, const snapshotRecord *records, unsigned int count) {
+  unsigned char buf[SNAPSHOT_CHUNK * SNAPSHOT_RECORD_LEN];
+  unsigned char *p;
+  unsigned int i, n;
+
+  while (count > 0) {
+    n = (count < SNAPSHOT_CHUNK) ? count : SNAPSHOT_CHUNK;
+
+    for (i = 0, p = buf; i < n; i++, p += SNAPSHOT_RECORD_LEN) {
+      memcpy(p, records[i].digest, DIGEST_LEN);
+      putDouble(p + DIGEST_LEN, records[i].tokens);
+      putDouble(p + DIGEST_LEN + 8, records[i].lastAccess);
+      putFloat(p + DIGEST_LEN + 16, records[i].ratio);
+      putFloat(p + DIGEST_LEN + 20, records[i].capacity);
+    }
+
+    if (fwrite(buf, SNAPSHOT_RECORD_LEN, n, handle) != n)
+      return -1;
+
+    records += n;
+    count -= n;
+  }
+
+  return 0;
+}
+
+// close
+int closeSnapshot(FILE *handle) {
+  int ret = 0;
+
+  if (fflush(handle) != 0 || ferror(handle))
+    ret = -1;
+  if (fclose(handle) != 0)
+    ret = -1;
+
+  return ret;
+}
+
+// read the whole file at once, then decode it
+int readSnapshot(const char *path, snapshotRecord **records, unsigned int *count) {
+  unsigned char header[SNAPSHOT_HEADER_LEN];
+  unsigned char *buf = NULL, *p;
+  snapshotRecord *out = NULL;
+  uint32_t magic;
+  long size;
+  unsigned int i, n;
+  FILE *handle;
+
+  *records = NULL;
+  *count = 0;
+
+  handle = fopen(path, "rb");
+  if (handle == NULL)
+    return -1;
+
+  if (fread(header, sizeof(header), 1, handle) != 1)
+    goto fail;
+  memcpy(&magic, header, sizeof(magic));
+  if (ntohl(magic) != SNAPSHOT_MAGIC || header[4] != SNAPSHOT_VERSION)
+    goto fail;
+
+  if (fseek(handle, 0, SEEK_END) != 0 || (size = ftell(handle)) < SNAPSHOT_HEADER_LEN)
+    goto fail;
+  size -= SNAPSHOT_HEADER_LEN;
+  if (size % SNAPSHOT_RECORD_LEN != 0 || size / SNAPSHOT_RECORD_LEN > 0xffffffffL)
+    goto fail;
+  n = size / SNAPSHOT_RECORD_LEN;
+  if (fseek(handle, SNAPSHOT_HEADER_LEN, SEEK_SET) != 0)
+    goto fail;
+
+  if (n > 0) {
+    buf = (unsigned char *)malloc((size_t)size);
+    out = (snapshotRecord *)malloc((size_t)n * sizeof(snapshotRecord));
+    if (buf == NULL || out == NULL || fread(buf, SNAPSHOT_RECORD_LEN, n, handle) != n)
+      goto fail;
+
+    for (i = 0, p = buf; i < n; i++, p += SNAPSHOT_RECORD_LEN) {
+      memcpy(out[i].digest, p, DIGEST_LEN);
+      out[i].tokens = getDouble(p + DIGEST_LEN);
+      out[i].lastAccess = getDouble(p + DIGEST_LEN + 8);
+      out[i].ratio = getFloat(p + DIGEST_LEN + 16);
+      out[i].capacity = getFloat(p + DIGEST_LEN + 20);
+    }
+    free(buf);
+  }
+
+  #ifdef DEBUG_SNAPSHOT
+    printf("snapshot.c: readSnapshot(): %d records in %s\n", n, path);
+  #endif
+
+  fclose(handle);
+  *records = out;
+  *count = n;
+  return 0;
+
+fail:
+  free(buf);
+  free(out);
+  fclose(handle);
+  return -1;
+}
@@ -0,0 +1,52 @@
+/*
+ *   Snapshot.
+ *   Binary dump of the live buckets, to carry the limiter state over to another node
+ */
+
+// libc includes
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+// DIGEST_LEN comes from varnish's cache/cache.h, include it first
+
+// file format: a header, then fixed size records until the end of the file
+#define SNAPSHOT_MAGIC       0x434c4d53   /* "CLMS" */
+#define SNAPSHOT_VERSION     1
+#define SNAPSHOT_HEADER_LEN  8
+#define SNAPSHOT_RECORD_LEN  (DIGEST_LEN + 24)
+
+// target number of imported buckets per partition
+#define SNAPSHOT_BUCKETS_PER_PARTITION 256
+
+/*
+ *  A snapshot record.
+ *  The bucket state: tokens at lastAccess (wall clock time), plus the
+ *  bucket parameters needed to refill it.
+ */
+struct __snapshotRecord {
+  unsigned char digest[DIGEST_LEN];
+  double tokens;
+  double lastAccess;
+  double ratio;
+  double capacity;
+};
+
+typedef struct __snapshotRecord snapshotRecord;
+
+/*
+ * Function prototypes.
+ */
+
+// create a snapshot file and write its header
+FILE *createSnapshot(const char *path);
+
+// append records to a snapshot file
+int writeSnapshot(FILE *handle, const snapshotRecord *records, unsigned int count);
+
+// close a snapshot file, returns non zero if some data could not be written
+int closeSnapshot(FILE *handle);
+
+// read a whole snapshot file. records are stored in *records (caller frees)
+int readSnapshot(const char *path, snapshotRecord **records, unsigned int *count);
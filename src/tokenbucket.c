@@ -21,6 +21,17 @@ bucket *allocateBucket(unsigned char *key, unsigned char *requester, unsigned ch
   // fill in data into new bucket
   newItem->capacity = bucketCapacity;
   newItem->ratio = hitRatio;
+  newItem->tokens = 0;
+  newItem->lastAccess = 0;
+  newItem->syncDelta = 0;
+  newItem->dirty = 0;
+  newItem->nextDirty = NULL;
+  newItem->parentBucket = NULL;
+  newItem->children = 0;
+  newItem->refs = 0;
+  newItem->slab = NULL;
+  newItem->requester = NULL;
+  newItem->resource = NULL;
   newItem->objectDigest = (unsigned char *)malloc((digest_len*sizeof(char)) + 1);
   if (newItem->objectDigest == NULL) {
 
@@ -64,9 +75,74 @@ bucket *allocateBucket(unsigned char *key, unsigned char *requester, unsigned ch
   return (struct __bucketItem *)newItem;
 }
 
+// allocate a slab: header, buckets and digests in one block
+bucketSlab *allocateBucketSlab(unsigned int count, unsigned int digest_len) {
+  bucketSlab *slab;
+
+  slab = (bucketSlab *)malloc(sizeof(bucketSlab) + (size_t)count * (sizeof(bucket) + digest_len + 1));
+  if (slab == NULL)
+    return NULL;
+
+  slab->live = 1;
+  slab->count = count;
+  slab->digestLen = digest_len;
+  slab->items = (bucket *)(slab + 1);
+  slab->digests = (unsigned char *)(slab->items + count);
+
+  #ifdef DEBUG_BUCKETQUEUE
+    printf("%s: 0x%X (%d buckets)\n","allocateBucketSlab(): Slab allocated at", slab, count);
+  #endif
+
+  return slab;
+}
+
+// slab buckets have no names
+static unsigned char no_name[1] = "";
+
+// fill in a slab bucket, like allocateBucket() does
+bucket *initSlabBucket(bucketSlab *slab, unsigned int index, const unsigned char *key, double hitRatio, double bucketCapacity) {
+  bucket *newItem = &slab->items[index];
+
+  newItem->capacity = bucketCapacity;
+  newItem->ratio = hitRatio;
+  newItem->tokens = 0;
+  newItem->lastAccess = 0;
+  newItem->syncDelta = 0;
+  newItem->dirty = 0;
+  newItem->nextDirty = NULL;
+  newItem->parentBucket = NULL;
+  newItem->children = 0;
+  newItem->refs = 0;
+  newItem->slab = slab;
+  newItem->objectDigest = slab->digests + (size_t)index * (slab->digestLen + 1);
+  memcpy(newItem->objectDigest, key, slab->digestLen);
+  newItem->objectDigest[slab->digestLen] = 0;
+  newItem->requester = no_name;
+  newItem->resource = no_name;
+  newItem->nextBucket = NULL;
+  newItem->prevBucket = NULL;
+
+  // buckets of a slab can be freed from different partitions at the same time
+  __atomic_add_fetch(&slab->live, 1, __ATOMIC_RELAXED);
+
+  return newItem;
+}
+
+// drop a slab reference, freeing the block with the last one
+void releaseBucketSlab(bucketSlab *slab) {
+  if (__atomic_sub_fetch(&slab->live, 1, __ATOMIC_ACQ_REL) == 0) {
+    #ifdef DEBUG_BUCKETQUEUE
+      printf("%s: 0x%X\n","releaseBucketSlab(): Deallocating Slab", slab);
+    #endif
+    free(slab);
+  }
+}
+
 // free bucket
 void freeBucket(bucket *item) {
-  if (item != NULL) {
+  if (item != NULL && item->slab != NULL) {
+    releaseBucketSlab(item->slab);
+  } else if (item != NULL) {
     // free digest memory
     if (item->objectDigest != NULL) {
 
@@ -175,54 +251,48 @@ bucket *lastBucket(bucket *headOfQueue) {
   else return lastBucket(headOfQueue->nextBucket);
 }
 
-// add bucket to queue
+// add bucket to queue.
+// the new bucket becomes the head: lists can hold many thousands of buckets
+// after an import, walking to the tail would make every insertion O(n)
 bucket *addBucket(bucket *item, bucket *headOfQueue) {
-  if (headOfQueue == NULL) {
-    // ad first item
-    #ifdef DEBUG_BUCKETQUEUE
-        printf("%s: 0x%X\n","addBucket(): adding new bucket at address", item);
-    #endif
-    headOfQueue = item;
-  } else {
-    // search last item in queue
-    bucket *lastInQueue = lastBucket(headOfQueue);
-
-    #ifdef DEBUG_BUCKETQUEUE
-        printf("%s: 0x%X after 0x%X\n","addBucket(): adding new bucket at address", item, lastInQueue);
-    #endif
+  #ifdef DEBUG_BUCKETQUEUE
+      printf("%s: 0x%X before 0x%X\n","addBucket(): adding new bucket at address", item, headOfQueue);
+  #endif
 
-    // add bucket in place
-    lastInQueue->nextBucket = item;
-    item->prevBucket = lastInQueue;
-  }
+  item->prevBucket = NULL;
+  item->nextBucket = headOfQueue;
+  if (headOfQueue != NULL)
+    headOfQueue->prevBucket = item;
 
-  return headOfQueue;
+  return item;
 }
 
 // destroy queue (CAUTION!)
 void freeBucketQueue(bucket *headOfQueue) {
-  if (headOfQueue->nextBucket != NULL) {
+  bucket *next;
 
+  // iterative: a recursion as deep as the list would overflow the stack on long lists
+  while (headOfQueue != NULL) {
+    next = headOfQueue->nextBucket;
+
+    // free resources
     #ifdef DEBUG_BUCKETQUEUE
-        printf("--> %s: 0x%X\n","freeBucketQueue(): recursing at address", headOfQueue);
+      printf("%s: 0x%X\n","freeBucketQueue(): freeing bucket at address", headOfQueue);
     #endif
-
-    freeBucketQueue(headOfQueue->nextBucket);
+    freeBucket(headOfQueue);
+    headOfQueue = next;
   }
-
-  // free resources
-  #ifdef DEBUG_BUCKETQUEUE
-    printf("%s: 0x%X\n","freeBucketQueue(): freeing bucket at address", headOfQueue);
-  #endif
-  freeBucket(headOfQueue);
 }
 
 // garbage collector function
-void cleanBucketQueue(bucket *headOfQueue, double timestamp) {
+bucket *cleanBucketQueue(bucket *headOfQueue, double timestamp, unsigned int *freed) {
+  double expiry;
   bucket *previous;
   bucket *next;
   bucket *holder = headOfQueue;
 
+  *freed = 0;
+
   #ifdef DEBUG_BUCKETQUEUE
     printf("cleanBucketQueue(): Starting list walk from address: 0x%X\n", holder);
   #endif
@@ -234,34 +304,49 @@ void cleanBucketQueue(bucket *headOfQueue, double timestamp) {
       printf("cleanBucketQueue(): ratio %f, timedelta %f, tokens %f, capacity %f\n", holder->ratio, (timestamp - holder->lastAccess), holder->tokens, holder->capacity);
     #endif
 
-    if (timestamp - holder->lastAccess > holder->capacity) {
+    next = holder->nextBucket;
+
+    // a bucket expires once it has been idle long enough to be full again:
+    // one capacity interval, more for buckets in debt
+    expiry = holder->capacity;
+    if (holder->tokens < 0 && holder->ratio > 0)
+      expiry = holder->capacity * (1 - holder->tokens / holder->ratio);
+
+    // parents are kept until all of their children are gone, pinned buckets until released,
+    // dirty buckets until cluster sync has sent their delta
+    if ((timestamp - holder->lastAccess > expiry) && (holder->children == 0) && (holder->refs == 0) && (holder->dirty == 0)) {
       // rewire the bucket queue
       previous = holder->prevBucket;
-      next = holder->nextBucket;
       // ok, do it.
       #ifdef DEBUG_BUCKETQUEUE
         printf("%s: new NEXT: 0x%X, new PREV: 0x%X\n","cleanBucketQueue(): Rewiring addresses:", next, previous);
       #endif
 
-      if (previous != NULL) {
-        if (previous->nextBucket != NULL) previous->nextBucket = next;
-      }
+      if (previous != NULL)
+        previous->nextBucket = next;
+      else
+        headOfQueue = next;
+
+      if (next != NULL)
+        next->prevBucket = previous;
 
-      if (next != NULL) {
-       if (next->prevBucket != NULL) next->prevBucket = previous;
-      }
+      if (holder->parentBucket != NULL)
+        holder->parentBucket->children--;
 
       #ifdef DEBUG_BUCKETQUEUE
         printf("%s: 0x%X\n","cleanBucketQueue(): freeing old bucket at address", holder);
       #endif
       // free bucket
       freeBucket(holder);
+      (*freed)++;
     }
 
     // advance...
     #ifdef DEBUG_BUCKETQUEUE
-        printf("-->%s: 0x%X\n","cleanBucketQueue(): recursing at address", holder->nextBucket);
+        printf("-->%s: 0x%X\n","cleanBucketQueue(): recursing at address", next);
     #endif
-    holder = holder->nextBucket;
+    holder = next;
   }
+
+  return headOfQueue;
 }
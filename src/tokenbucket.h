@@ -13,6 +13,8 @@
 #include <cache/cache.h>
 #include <vsha256.h>
 
+struct __bucketSlab;
+
 /*
  *  A bucket item.
  *  This structure wraps a single call from outside Varnish
@@ -34,6 +36,19 @@ struct __bucketItem {
   unsigned char *resource;
   // num tokens
   double tokens;
+  // tokens consumed locally since the last cluster sync flush
+  double syncDelta;
+  // on the dirty list of its partition (syncDelta waiting to be sent), kept by the GC until flushed
+  unsigned int dirty;
+  struct __bucketItem *nextDirty;
+  // parent bucket (hierarchical quotas), lives in the same list
+  struct __bucketItem *parentBucket;
+  // number of child buckets pointing to this one
+  unsigned int children;
+  // number of handles pinning this bucket (deferred charging)
+  unsigned int refs;
+  // slab this bucket was carved from (bulk import), NULL for buckets allocated one by one
+  struct __bucketSlab *slab;
   // next item
   struct __bucketItem *nextBucket;
   // previous item
@@ -42,6 +57,22 @@ struct __bucketItem {
 
 typedef struct __bucketItem bucket;
 
+/*
+ *  A block of buckets allocated at once.
+ *  Slab buckets share the block for their digests and have no requester or
+ *  resource names; the block is released with the last of its buckets.
+ */
+struct __bucketSlab {
+  // buckets still in use, plus one reference held while the slab is being filled
+  unsigned int live;
+  unsigned int count;
+  unsigned int digestLen;
+  bucket *items;
+  unsigned char *digests;
+};
+
+typedef struct __bucketSlab bucketSlab;
+
 /*
  * Function prototypes.
  */
@@ -52,6 +83,15 @@ bucket *allocateBucket(unsigned char *key, unsigned char*requester, unsigned cha
 // free a bucket and release memory
 void freeBucket(bucket *item);
 
+// allocate room for count buckets in a single block
+bucketSlab *allocateBucketSlab(unsigned int count, unsigned int digest_len);
+
+// initialize the index-th bucket of a slab
+bucket *initSlabBucket(bucketSlab *slab, unsigned int index, const unsigned char *key, double hitRatio, double bucketCapacity);
+
+// drop the reference held while filling the slab
+void releaseBucketSlab(bucketSlab *slab);
+
 // remove bucket from the linked list
 void removeBucket(bucket *item);
 
@@ -64,6 +104,6 @@ bucket *addBucket(bucket *item, bucket *headOfQueue);
 // destroy queue (CAUTION! this completely frees all entries in the linked list)
 void freeBucketQueue(bucket *headOfQueue);
 
-// garbage collector function
-void cleanBucketQueue(bucket *headOfQueue, double timestamp);
+// garbage collector function, returns the new head of the queue and the number of freed buckets in *freed
+bucket *cleanBucketQueue(bucket *headOfQueue, double timestamp, unsigned int *freed);
 
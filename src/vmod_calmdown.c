@@ -7,13 +7,32 @@
  * All code is released under the terms of the GNU General Public License version 3.
  */
 
+// dladdr()
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <dlfcn.h>
 
 #include "vcl.h"
 #include "vrt.h"
 #include "tokenbucket.h"
 #include "yamlparser.h"
+#include "clustersync.h"
+#include "heavyhitters.h"
+#include "allowlist.h"
+#include "partitions.h"
+#include "sessioncache.h"
+#include "snapshot.h"
+#include "vtim.h"
+#include "vcli.h"
+#include "vcli_serve.h"
 
 #include <sys/time.h>
 #include "vcc_if.h"
@@ -21,28 +40,23 @@
 #define TRUE   1
 #define FALSE  0
 
-// config file
+// config file, the VMOD_CALMDOWN_CONFIG environment variable overrides it
 #define CFGFILE  "/etc/vmod-calmdown/calmdown.yaml"
+#define CFGFILE_ENV  "VMOD_CALMDOWN_CONFIG"
 FILE *yaml_config_file_descriptor;
 
-// bucket list struct
-struct __bucketList {
-  pthread_mutex_t list_mutex;
-  bucket *listHead;
-  int gc_count;
-};
-typedef struct __bucketList bucketList;
-
-// list group
-bucketList *buckets;
-// seek bucket list pointers
-bucketList *get_bucket(int index) {
-  return (buckets + (index * sizeof(struct __bucketList)));
-}
-
 // global module variables
 static pthread_mutex_t global_initialization_mutex = PTHREAD_MUTEX_INITIALIZER;
-static unsigned int need_init = TRUE;
+// number of loaded VCLs importing the module: the first one allocates, the last one frees
+static unsigned int loaded_vcls = 0;
+// varnishadm commands are registered once, with the module pinned in memory
+static unsigned int cli_registered = FALSE;
+
+// cluster sync is running: local consumption is recorded for the peers
+static unsigned int sync_enabled = FALSE;
+
+// exempt requesters, compiled once at load time and read without locks
+static allowlist exempt;
 
 // calculate and update token bucket size
 static void calc_tokens(bucket *b, double now) {
@@ -51,10 +65,14 @@ static void calc_tokens(bucket *b, double now) {
     printf("vmod_calmdown.c: calc_tokens() called, current timestamp %f, lastAccess timestamp %f...\n", now, b->lastAccess);
   #endif
 
-  // update tokens with respect to relative delay in requests
-  b->tokens += (double) ((delta / b->capacity) * b->ratio);
-  if (b->tokens > b->capacity)
-    b->tokens = b->capacity;
+  // update tokens with respect to relative delay in requests:
+  // 'ratio' tokens every 'capacity' seconds, up to 'ratio' tokens
+  if (delta > 0) {
+    b->tokens += (double) ((delta / b->capacity) * b->ratio);
+    b->lastAccess = now;
+  }
+  if (b->tokens > b->ratio)
+    b->tokens = b->ratio;
 }
 
 // get timestamp for the current request from varnish loop
@@ -93,7 +111,10 @@ bucket *handle_bucket(unsigned char hash[DIGEST_LEN], VCL_STRING requester, VCL_
   } else {
     // allocate and insert new bucket
     item = allocateBucket(hash, (unsigned char *)requester, (unsigned char *)resource, digest_length, ratio, capacity);
+    if (item == NULL)
+      return NULL;
     headOfList->listHead = addBucket(item, headOfList->listHead);
+    headOfList->buckets++;
 
     // return new address
     return item;
@@ -102,29 +123,71 @@ bucket *handle_bucket(unsigned char hash[DIGEST_LEN], VCL_STRING requester, VCL_
 
 // garbage collector.
 // cleans dead entries
-static void run_gc(double now, unsigned part) {
-  bucketList *v = get_bucket(part);
+static void run_gc(double now, bucketList *v) {
+  unsigned int freed;
   #ifdef DEBUG_BUCKETQUEUE
     printf("vmod_calmdown.c: run_gc() called, starting at: 0x%X\n", v->listHead);
   #endif
 
   //run garbage collector
-  cleanBucketQueue(v->listHead, now);
-  // unlock mutex
+  v->listHead = cleanBucketQueue(v->listHead, now, &freed);
+  v->buckets -= freed;
+  if (freed > 0)
+    v->generation++;
 }
 
-// main ban function and parameters
-VCL_BOOL vmod_calmdown(const struct vrt_ctx *ctx, VCL_STRING requester, VCL_STRING resource, VCL_INT ratio, VCL_DURATION capacity) {
-  unsigned ret = 1;
+// record tokens consumed locally for cluster sync. the bucket joins the dirty list
+// of its partition, so that sync_collect() only visits the buckets that changed.
+// called with the partition mutex held
+static void sync_track(bucketList *v, bucket *b, double delta) {
+  if (!sync_enabled || delta == 0)
+    return;
+
+  b->syncDelta += delta;
+  if (!b->dirty) {
+    b->dirty = 1;
+    b->nextDirty = v->dirtyHead;
+    v->dirtyHead = b;
+  }
+}
+
+// count a decision and run the garbage collector every gc_interval decisions.
+// called with the partition mutex held
+static void count_gc(double now, bucketList *v, unsigned denied) {
+  if (denied)
+    v->denied++;
+  else
+    v->allowed++;
+
+  v->gc_count++;
+  #ifdef DEBUG_BUCKETQUEUE
+    printf("vmod_calmdown.c: count_gc(): %d requests done, %d more to trigger Garbage Collection.\n", v->gc_count, global_opts.gc_interval - v->gc_count);
+  #endif
+  if (v->gc_count == global_opts.gc_interval) {
+    #ifdef DEBUG_BUCKETQUEUE
+      printf("vmod_calmdown.c: count_gc(): Entering Garbage Collection...\n");
+    #endif
+
+    run_gc(now, v);
+    v->gc_count = 0;
+
+    #ifdef DEBUG_BUCKETQUEUE
+      printf("vmod_calmdown.c: count_gc(): GC END: %d requests done, %d more to trigger Garbage Collection.\n", v->gc_count, global_opts.gc_interval - v->gc_count);
+    #endif
+  }
+}
 
-  // composite requester variable.
-  // the bucket requester is "key" from the VCL + "resource" from the VCL
-  // for example: client.identity + req.url --> "192.168.0.1" + "/api/resource"
-  unsigned char *compound_requester = NULL;
-  unsigned int compound_size;
+// take cost tokens from the bucket of requester + resource.
+// the request is admitted while the bucket holds its cost, or the whole bucket for a cost
+// larger than the ratio (which takes it into debt, paid back by later refills). With
+// handle != NULL the cost is charged later: the request needs a whole token, and the
+// admitted bucket is pinned (the GC skips it) and returned, see vmod_admit()
+static unsigned take_tokens(const struct vrt_ctx *ctx, VCL_STRING requester, VCL_STRING resource, double cost, VCL_INT ratio, VCL_DURATION capacity, bucket **handle) {
+  unsigned ret = 1;
+  double need;
 
   // requester bucket
-  bucket *b;
+  bucket *b = NULL;
 
   // get timestamp from request context
   double now = get_ts_now(ctx);
@@ -132,105 +195,754 @@ VCL_BOOL vmod_calmdown(const struct vrt_ctx *ctx, VCL_STRING requester, VCL_STRI
   // bucket list header
   bucketList *v;
   unsigned char digest[DIGEST_LEN];
-  unsigned part;
+
+  // client session, for the session cache
+  const struct sess *sp = NULL;
+  sessionSlot *slot = NULL;
+  unsigned cached;
+
+  // initialize SHA256 hash engine
+  SHA256_CTX sctx;
 
   if (!requester)
     return (1);
+  if (!resource)
+    resource = "";
 
-  // build compound requester
-  compound_size = strlen(requester) + strlen(resource) + 1;
-  compound_requester = (unsigned char*)malloc(compound_size);
-  // handle OOM
-  if (compound_requester == NULL)
-      return (1);
+  // allowlisted requesters skip hashing, locking and bucket allocation
+  if (matchAllowlist(&exempt, requester))
+    return (0);
+
+  // the bucket used by the previous request of this session, if the key is the same
+  if (ctx->req != NULL && ctx->req->sp != NULL) {
+    sp = ctx->req->sp;
+    slot = lockSessionSlot(sp, sp->vxid);
+  }
+  if (slot != NULL) {
+    b = lookupSessionSlot(slot, sp, sp->vxid, &v);
+    if (b != NULL && (strcmp((char *)b->requester, requester) != 0 || strcmp((char *)b->resource, resource) != 0)) {
+      unlockPartition(v);
+      b = NULL;
+    }
+  }
+  cached = (b != NULL);
 
-  bzero(compound_requester, compound_size);
-  memcpy(compound_requester, requester, strlen(requester));
-  memcpy(compound_requester + strlen(requester), resource, strlen(resource));
+  if (b == NULL) {
+    // composite requester.
+    // the bucket requester is "key" from the VCL + "resource" from the VCL
+    // for example: client.identity + req.url --> "192.168.0.1" + "/api/resource"
+    // calculate SHA256 digest of requester (ip address, url location, URI....),
+    // hashing both strings in place, followed by a NUL byte
+    SHA256_Init(&sctx);
+    SHA256_Update(&sctx, requester, strlen(requester));
+    SHA256_Update(&sctx, resource, strlen(resource) + 1);
+    SHA256_Final(digest, &sctx);
 
-  // assert MAX_BUCKET_LISTS is a power of 2
-  if (global_opts.partitions & (global_opts.partitions -1))
+    // select and lock the bucket list that owns this digest
+    v = lockPartition(digest);
+    #ifdef DEBUG_BUCKETQUEUE
+      printf("vmod_calmdown.c: take_tokens(): Selected bucketList 0x%X \n", v);
+      printf("vmod_calmdown.c: take_tokens(): Selected listHead is at 0x%X \n", v->listHead);
+    #endif
+
+    // search and get relevant bucket and calculate tokens
+    // if requester is new, allocate a new bucket.
+    b = handle_bucket(digest, requester, resource, ratio, capacity, now, DIGEST_LEN, v);
+    if (b == NULL) {
+      // handle OOM
+      unlockPartition(v);
+      if (slot != NULL)
+        unlockSessionSlot(slot);
       return (1);
+    }
+  }
+
+  calc_tokens(b, now);
+  // a fraction refilled since the last request is not enough
+  need = (handle != NULL) ? 1 : cost;
+  if (need > b->ratio)
+    need = b->ratio;
+  if (b->tokens >= need) {
+    b->tokens -= cost;
+    sync_track(v, b, cost);
+    ret = 0;
+    if (handle != NULL) {
+      b->refs++;
+      *handle = b;
+    }
+  }
 
-  // initialize SHA256 hash engine
-  SHA256_CTX sctx;
-  // calculate SHA256 digest of requester (ip address, url location, URI....)
-  SHA256_Init(&sctx);
-  SHA256_Update(&sctx, compound_requester, compound_size);
-  SHA256_Final(digest, &sctx);
-
-  // select list based on hash.
-  // use modular arithmetics:
-  //
-  // X % Y (where y is a power of 2) is equivalent to: X & (Y-1)
-  //
-  // Take Y=32 for example (which is 2^5) and Y-1=31
-  // 32 dec == 00100000 bin
-  // 31 dec == 00011111 bin
-  //
-  // so, any multiple of a number like Y=2^N must end with N bits set as 0
-  // the remainder of a division by Y=2^N is the same number with all bits discarded except for
-  // the last N
-  //
-  // by AND-ing the original number with 2^N-1, you mask out all bits except for the N-1 bits
-  // significant for the remainder (== 0 if multiple, != 0 if not multiple)
-  //
-  // get bucket list (16 bit requester..)
-  part = (digest[0] << 8 | digest[1]) & (global_opts.partitions - 1);
-  v = get_bucket(part);
   #ifdef DEBUG_BUCKETQUEUE
-    printf("vmod_calmdown.c: calmdown(): Selected hash container ID %d\n", part);
-    printf("vmod_calmdown.c: calmdown(): Selected bucketList 0x%X \n", v);
-    printf("vmod_calmdown.c: calmdown(): Selected listHead is at 0x%X \n", v->listHead);
+    printf("take_tokens(): ratio %f, cost %f, tokens %f, capacity %f\n", b->ratio, cost, b->tokens, b->capacity);
   #endif
 
-  // lock queue mutex
-  AZ(pthread_mutex_lock(&v->list_mutex));
+  // track heavy hitters
+  updateHeavyHitters(&v->topk, b->objectDigest, requester, resource, ret);
+
+  // run garbage collector....
+  count_gc(now, v, ret);
+  if (slot != NULL) {
+    if (cached)
+      v->sessionHits++;
+    else
+      v->sessionMisses++;
+  }
+
+  // remember the bucket for the next request of this session, after the GC so that
+  // the generation is current. buckets created by cluster sync or import have no names, they
+  // can not be validated and are not cached
+  if (slot != NULL && strcmp((char *)b->requester, requester) == 0)
+    storeSessionSlot(slot, sp, sp->vxid, b, v);
+
+  // unlock queue mutex
+  unlockPartition(v);
+  if (slot != NULL)
+    unlockSessionSlot(slot);
+  return (ret);
+}
+
+// main ban function and parameters
+VCL_BOOL vmod_calmdown(const struct vrt_ctx *ctx, VCL_STRING requester, VCL_STRING resource, VCL_INT ratio, VCL_DURATION capacity) {
+  return (take_tokens(ctx, requester, resource, 1, ratio, capacity, NULL));
+}
+
+// weighted requests: take cost tokens at once
+VCL_BOOL vmod_consume(const struct vrt_ctx *ctx, VCL_STRING key, VCL_REAL cost, VCL_INT ratio, VCL_DURATION capacity) {
+  if (cost < 0)
+    cost = 0;
+  return (take_tokens(ctx, key, "", cost, ratio, capacity, NULL));
+}
+
+// release the bucket pinned by vmod_admit() at the end of the task
+static void release_handle(void *ptr) {
+  bucket *b = (bucket *)ptr;
+  bucketList *v;
 
-  // search and get relevant bucket and calculate tokens
-  // if requester is new, calculate SHA256 hash and allocate a new bucket.
-  b = handle_bucket(digest, requester, resource, ratio, capacity, now, DIGEST_LEN, v);
+  if (b == NULL)
+    return;
+
+  // the bucket may have moved to another partition meanwhile
+  v = lockPartition(b->objectDigest);
+  assert(b->refs > 0);
+  b->refs--;
+  unlockPartition(v);
+}
+
+// deferred charging, first half: admit the request without taking tokens,
+// and keep a handle to the bucket in the task for vmod_charge()
+VCL_BOOL vmod_admit(const struct vrt_ctx *ctx, struct vmod_priv *priv, VCL_STRING key, VCL_INT ratio, VCL_DURATION capacity) {
+  bucket *b = NULL;
+  unsigned ret;
+
+  AN(priv);
+  if (priv->priv != NULL) {
+    release_handle(priv->priv);
+    priv->priv = NULL;
+  }
+
+  ret = take_tokens(ctx, key, "", 0, ratio, capacity, &b);
+  if (b != NULL) {
+    priv->priv = b;
+    priv->free = release_handle;
+  }
+
+  return (ret);
+}
+
+// deferred charging, second half: charge the actual cost (response bytes, ...)
+// to the bucket admitted earlier in the same task. no hashing and no search:
+// the handle only needs the directory to find the bucket's current partition
+VCL_VOID vmod_charge(const struct vrt_ctx *ctx, struct vmod_priv *priv, VCL_REAL cost) {
+  bucket *b;
+  bucketList *v;
+  double now = get_ts_now(ctx);
+
+  AN(priv);
+  b = (bucket *)priv->priv;
+  if (b == NULL || cost <= 0)
+    return;
+
+  v = lockPartition(b->objectDigest);
   calc_tokens(b, now);
-  if (b->tokens > 0) {
-    b->tokens -= 1;
+  b->tokens -= cost;
+  sync_track(v, b, cost);
+  unlockPartition(v);
+}
+
+// hierarchical quotas: a tenant bucket with per-user child buckets.
+//
+// the child digest borrows its first PARTITION_PREFIX_LEN bytes from the parent digest,
+// so both buckets always live in the same partition: a single lock covers the whole
+// decision, and the child keeps a pointer to its parent, so once the child exists the
+// parent costs no extra search. Tokens are only consumed when both levels have some
+// left, so a denial never needs a refund.
+VCL_BOOL vmod_hierarchical(const struct vrt_ctx *ctx, VCL_STRING tenant, VCL_INT tenantRatio, VCL_DURATION tenantCapacity, VCL_STRING user, VCL_INT userRatio, VCL_DURATION userCapacity, VCL_STRING resource) {
+  unsigned ret = 1;
+  bucket *parent, *child;
+  bucketList *v;
+  unsigned char parentDigest[DIGEST_LEN];
+  unsigned char childDigest[DIGEST_LEN];
+  SHA256_CTX sctx, cctx;
+  double now = get_ts_now(ctx);
+
+  if (!tenant || !user)
+    return (1);
+  if (!resource)
+    resource = "";
+
+  // allowlisted tenants or users skip the whole thing
+  if (matchAllowlist(&exempt, tenant) || matchAllowlist(&exempt, user))
+    return (0);
+
+  // parent key: tenant \0 resource \0
+  // child key:  tenant \0 resource \0 user \0
+  // the child hash resumes from a copy of the parent state, the shared prefix is hashed once.
+  // NUL separators keep these keys apart from the ones built by calmdown()
+  SHA256_Init(&sctx);
+  SHA256_Update(&sctx, tenant, strlen(tenant) + 1);
+  SHA256_Update(&sctx, resource, strlen(resource) + 1);
+  cctx = sctx;
+  SHA256_Final(parentDigest, &sctx);
+  SHA256_Update(&cctx, user, strlen(user) + 1);
+  SHA256_Final(childDigest, &cctx);
+  memcpy(childDigest, parentDigest, PARTITION_PREFIX_LEN);
+
+  // lock queue mutex
+  v = lockPartition(parentDigest);
+
+  child = handle_bucket(childDigest, user, resource, userRatio, userCapacity, now, DIGEST_LEN, v);
+  if (child == NULL) {
+    // handle OOM
+    unlockPartition(v);
+    return (1);
+  }
+
+  // new child (or one created by cluster sync): link it to its parent
+  parent = child->parentBucket;
+  if (parent == NULL) {
+    parent = handle_bucket(parentDigest, tenant, resource, tenantRatio, tenantCapacity, now, DIGEST_LEN, v);
+    if (parent == NULL) {
+      // handle OOM
+      unlockPartition(v);
+      return (1);
+    }
+    child->parentBucket = parent;
+    parent->children++;
+  }
+
+  calc_tokens(parent, now);
+  calc_tokens(child, now);
+  if (child->tokens >= 1 && parent->tokens >= 1) {
+    child->tokens -= 1;
+    sync_track(v, child, 1);
+    parent->tokens -= 1;
+    sync_track(v, parent, 1);
     ret = 0;
-    b->lastAccess = now;
   }
 
   #ifdef DEBUG_BUCKETQUEUE
-    printf("calmdown(): ratio %f, timedelta %f, tokens %f, capacity %f\n", b->ratio, (now - b->lastAccess), b->tokens, b->capacity);
+    printf("hierarchical(): tenant tokens %f, user tokens %f\n", parent->tokens, child->tokens);
   #endif
 
+  // track heavy hitters
+  updateHeavyHitters(&v->topk, childDigest, user, resource, ret);
+
   // run garbage collector....
-  v->gc_count++;
-  #ifdef DEBUG_BUCKETQUEUE
-    printf("vmod_calmdown.c: calmdown(): %d requests done, %d more to trigger Garbage Collection.\n", v->gc_count, global_opts.gc_interval - v->gc_count);
-  #endif
-  if (v->gc_count == global_opts.gc_interval) {
-    #ifdef DEBUG_BUCKETQUEUE
-      printf("vmod_calmdown.c: calmdown(): Entering Garbage Collection...\n");
-    #endif
+  count_gc(now, v, ret);
 
-    run_gc(now, part);
-    v->gc_count = 0;
+  // unlock queue mutex
+  unlockPartition(v);
+  return (ret);
+}
+
+// cluster sync: collect the tokens consumed locally since the last flush.
+// each partition is locked only while its dirty list is walked
+static unsigned int sync_collect(syncRecord **records) {
+  unsigned int count = 0, size = 0;
+  unsigned p;
+  syncRecord *out = NULL;
+
+  for (p = 0; p < partitionCount(); p++) {
+    bucketList *v = getPartition(p);
+    bucket *b;
+
+    AZ(pthread_mutex_lock(&v->list_mutex));
+    while ((b = v->dirtyHead) != NULL) {
+      if (count == size) {
+        syncRecord *grown;
+        size = size ? size * 2 : 256;
+        grown = (syncRecord *)realloc(out, size * sizeof(syncRecord));
+        if (grown == NULL)
+          break;
+        out = grown;
+      }
+
+      memcpy(out[count].digest, b->objectDigest, DIGEST_LEN);
+      out[count].delta = b->syncDelta;
+      out[count].ratio = b->ratio;
+      out[count].capacity = b->capacity;
+      v->dirtyHead = b->nextDirty;
+      b->nextDirty = NULL;
+      b->dirty = 0;
+      b->syncDelta = 0;
+      count++;
+    }
+    AZ(pthread_mutex_unlock(&v->list_mutex));
+  }
+
+  *records = out;
+  return count;
+}
+
+// cluster sync: merge the tokens consumed by a peer into the local bucket.
+// remote deltas do not touch syncDelta, so they are never sent back
+static void sync_merge(const syncRecord *record, double now) {
+  bucketList *v = lockPartition(record->digest);
+  bucket *b;
+
+  b = handle_bucket((unsigned char *)record->digest, "", "", record->ratio, record->capacity, now, DIGEST_LEN, v);
+  if (b != NULL) {
+    calc_tokens(b, now);
+    b->tokens -= record->delta;
+  }
+  unlockPartition(v);
+}
+
+// sum a counter over all partitions. reads are not locked, values are
+// exact only when no request is in flight
+static uint64_t sum_counter(VCL_ENUM which) {
+  uint64_t total = 0;
+  unsigned int p, partitions = partitionCount();
+
+  if (strcmp(which, "partitions") == 0)
+    return partitions;
+
+  for (p = 0; p < partitions; p++) {
+    bucketList *v = getPartition(p);
+    if (strcmp(which, "buckets") == 0)
+      total += v->buckets;
+    else if (strcmp(which, "allowed") == 0)
+      total += v->allowed;
+    else if (strcmp(which, "denied") == 0)
+      total += v->denied;
+    else if (strcmp(which, "session_hits") == 0)
+      total += v->sessionHits;
+    else if (strcmp(which, "session_misses") == 0)
+      total += v->sessionMisses;
+  }
+
+  return total;
+}
+
+// module counters, for VCL and tests
+VCL_INT vmod_counter(const struct vrt_ctx *ctx, VCL_ENUM which) {
+  (void) ctx;
+  return ((VCL_INT)sum_counter(which));
+}
 
+// varnishadm "calmdown.stats": module counters
+static void cli_calmdown_stats(struct cli *cli, const char * const *av, void *priv) {
+  (void) av;
+  (void) priv;
+
+  AZ(pthread_mutex_lock(&global_initialization_mutex));
+  VCLI_Out(cli, "partitions      %ju\n", (uintmax_t)sum_counter("partitions"));
+  VCLI_Out(cli, "buckets         %ju\n", (uintmax_t)sum_counter("buckets"));
+  VCLI_Out(cli, "allowed         %ju\n", (uintmax_t)sum_counter("allowed"));
+  VCLI_Out(cli, "denied          %ju\n", (uintmax_t)sum_counter("denied"));
+  VCLI_Out(cli, "session_hits    %ju\n", (uintmax_t)sum_counter("session_hits"));
+  VCLI_Out(cli, "session_misses  %ju\n", (uintmax_t)sum_counter("session_misses"));
+  AZ(pthread_mutex_unlock(&global_initialization_mutex));
+}
+
+// varnishadm "calmdown.top [N]": dump the N busiest keys (default 10).
+// partition tables are copied under their mutex, sorting and formatting
+// happen after all locks are released.
+static void cli_calmdown_top(struct cli *cli, const char * const *av, void *priv) {
+  hhEntry *snapshot;
+  unsigned int count = 0, size = 0, limit = 10, i, partitions;
+  unsigned long value;
+  unsigned p;
+  char *end;
+  (void) priv;
+
+  // a positive decimal number: no sign, no trailing characters
+  if (av[2] != NULL) {
+    errno = 0;
+    value = isdigit((unsigned char)av[2][0]) ? strtoul(av[2], &end, 10) : 0;
+    if (value == 0 || *end != '\0' || errno != 0 || value > UINT_MAX) {
+      VCLI_Out(cli, "N must be a positive number\n");
+      VCLI_SetResult(cli, CLIS_PARAM);
+      return;
+    }
+    limit = (unsigned int)value;
+  }
+
+  AZ(pthread_mutex_lock(&global_initialization_mutex));
+  // table sizes are fixed at allocation time; partitions created
+  // after this point are left out of the snapshot
+  partitions = partitionCount();
+  for (p = 0; p < partitions; p++)
+    size += getPartition(p)->topk.size;
+
+  if (size == 0) {
+    AZ(pthread_mutex_unlock(&global_initialization_mutex));
+    VCLI_Out(cli, "heavy hitters tracking is disabled\n");
+    VCLI_SetResult(cli, CLIS_CANT);
+    return;
+  }
+
+  snapshot = (hhEntry *)malloc(size * sizeof(hhEntry));
+  if (snapshot == NULL) {
+    AZ(pthread_mutex_unlock(&global_initialization_mutex));
+    VCLI_SetResult(cli, CLIS_CANT);
+    return;
+  }
+
+  for (p = 0; p < partitions; p++) {
+    bucketList *v = getPartition(p);
+    AZ(pthread_mutex_lock(&v->list_mutex));
+    count += snapshotHeavyHitters(&v->topk, snapshot + count);
+    AZ(pthread_mutex_unlock(&v->list_mutex));
+  }
+  AZ(pthread_mutex_unlock(&global_initialization_mutex));
+
+  // a key lives in exactly one partition: merging is just sorting
+  sortHeavyHitters(snapshot, count);
+  if (limit > count)
+    limit = count;
+
+  VCLI_Out(cli, "%-12s %-12s %-12s %s\n", "requests", "denies", "error", "key");
+  for (i = 0; i < limit; i++) {
+    VCLI_Out(cli, "%-12ju %-12ju %-12ju %s\n", (uintmax_t)snapshot[i].requests, (uintmax_t)snapshot[i].denies, (uintmax_t)snapshot[i].error, snapshot[i].label);
+  }
+
+  free(snapshot);
+}
+
+static const struct cli_cmd_desc cli_calmdown_top_desc = {
+  .request = "calmdown.top",
+  .syntax = "calmdown.top [N]",
+  .help = "\tShow the N most active rate-limited keys (default 10).",
+  .minarg = 0,
+  .maxarg = 1
+};
+
+static const struct cli_cmd_desc cli_calmdown_stats_desc = {
+  .request = "calmdown.stats",
+  .syntax = "calmdown.stats",
+  .help = "\tShow the number of partitions, live buckets and decisions.",
+  .minarg = 0,
+  .maxarg = 0
+};
+
+// varnishadm "calmdown.export <file>": dump the live buckets.
+// each partition is locked only while its buckets are copied, the file is
+// written with no lock held, so traffic keeps flowing. a partition split while
+// the dump is running can make some buckets appear twice, import skips them
+static void cli_calmdown_export(struct cli *cli, const char * const *av, void *priv) {
+  snapshotRecord *records = NULL;
+  unsigned int count, size = 0, total = 0, p;
+  FILE *handle;
+  int failed = 0;
+  (void) priv;
+
+  AZ(pthread_mutex_lock(&global_initialization_mutex));
+  handle = createSnapshot(av[2]);
+  if (handle == NULL) {
+    AZ(pthread_mutex_unlock(&global_initialization_mutex));
+    VCLI_Out(cli, "cannot create %s\n", av[2]);
+    VCLI_SetResult(cli, CLIS_CANT);
+    return;
+  }
+
+  for (p = 0; p < partitionCount() && !failed; p++) {
+    bucketList *v = getPartition(p);
+    bucket *b;
+
+    AZ(pthread_mutex_lock(&v->list_mutex));
+    if (v->buckets > size) {
+      snapshotRecord *grown = (snapshotRecord *)realloc(records, v->buckets * 2 * sizeof(snapshotRecord));
+      if (grown == NULL) {
+        AZ(pthread_mutex_unlock(&v->list_mutex));
+        failed = 1;
+        break;
+      }
+      records = grown;
+      size = v->buckets * 2;
+    }
+
+    count = 0;
+    for (b = v->listHead; b != NULL && count < size; b = b->nextBucket) {
+      memcpy(records[count].digest, b->objectDigest, DIGEST_LEN);
+      records[count].tokens = b->tokens;
+      records[count].lastAccess = b->lastAccess;
+      records[count].ratio = b->ratio;
+      records[count].capacity = b->capacity;
+      count++;
+    }
+    AZ(pthread_mutex_unlock(&v->list_mutex));
+
+    if (writeSnapshot(handle, records, count) != 0)
+      failed = 1;
+    total += count;
+  }
+  AZ(pthread_mutex_unlock(&global_initialization_mutex));
+
+  free(records);
+  if (closeSnapshot(handle) != 0 || failed) {
+    VCLI_Out(cli, "failed to write %s\n", av[2]);
+    VCLI_SetResult(cli, CLIS_CANT);
+    return;
+  }
+
+  VCLI_Out(cli, "%u buckets exported to %s\n", total, av[2]);
+}
+
+// snapshot records in partition order.
+// a partition owns the digests whose low `depth` selector bits match: ordering records
+// by the low selector bits reversed (least significant first) makes the records of any
+// partition contiguous, whatever its depth (up to 16, MAX_PARTITIONS)
+static unsigned int snapshot_order(const unsigned char *digest) {
+  unsigned int lo = digest[PARTITION_PREFIX_LEN - 1], hi = digest[PARTITION_PREFIX_LEN - 2];
+
+  lo = (lo & 0xf0) >> 4 | (lo & 0x0f) << 4;
+  lo = (lo & 0xcc) >> 2 | (lo & 0x33) << 2;
+  lo = (lo & 0xaa) >> 1 | (lo & 0x55) << 1;
+  hi = (hi & 0xf0) >> 4 | (hi & 0x0f) << 4;
+  hi = (hi & 0xcc) >> 2 | (hi & 0x33) << 2;
+  hi = (hi & 0xaa) >> 1 | (hi & 0x55) << 1;
+
+  return (lo << 8 | hi);
+}
+
+// records with the same order are sorted by digest: duplicates end up side by side
+static int compare_snapshot_records(const void *a, const void *b) {
+  return memcmp(((const snapshotRecord *)a)->digest, ((const snapshotRecord *)b)->digest, DIGEST_LEN);
+}
+
+// bsearch() key: a bucket digest
+static int compare_snapshot_key(const void *key, const void *record) {
+  const unsigned char *digest = ((const snapshotRecord *)record)->digest;
+  unsigned int ka = snapshot_order((const unsigned char *)key), kb = snapshot_order(digest);
+
+  if (ka != kb)
+    return (ka < kb) ? -1 : 1;
+  return memcmp(key, digest, DIGEST_LEN);
+}
+
+// counting sort on the order, then sort each (small) run by digest
+static snapshotRecord *sort_snapshot(snapshotRecord *records, unsigned int count) {
+  unsigned int *start, i, k;
+  snapshotRecord *sorted;
+
+  start = (unsigned int *)calloc(65536 + 1, sizeof(unsigned int));
+  sorted = (snapshotRecord *)malloc((size_t)(count ? count : 1) * sizeof(snapshotRecord));
+  if (start == NULL || sorted == NULL) {
+    free(start);
+    free(sorted);
+    return NULL;
+  }
+
+  for (i = 0; i < count; i++)
+    start[snapshot_order(records[i].digest) + 1]++;
+  for (k = 0; k < 65536; k++)
+    start[k + 1] += start[k];
+  for (i = 0; i < count; i++)
+    sorted[start[snapshot_order(records[i].digest)]++] = records[i];
+
+  // start[k] is now the end of run k
+  for (k = 0, i = 0; k < 65536; i = start[k++]) {
+    if (start[k] - i > 1)
+      qsort(sorted + i, start[k] - i, sizeof(snapshotRecord), compare_snapshot_records);
+  }
+
+  free(start);
+  free(records);
+  return sorted;
+}
+
+// the tokens left in a record at time now
+static double snapshot_tokens(const snapshotRecord *record, double now) {
+  bucket tmp;
+
+  tmp.tokens = record->tokens;
+  tmp.lastAccess = record->lastAccess;
+  tmp.ratio = record->ratio;
+  tmp.capacity = record->capacity;
+  calc_tokens(&tmp, now);
+  return tmp.tokens;
+}
+
+// varnishadm "calmdown.import <file>": load buckets exported by another node.
+// partitions are split beforehand to keep lists short, records are sorted in
+// partition order so each partition is locked once, and all the new buckets come
+// from a single slab allocation. a bucket that already exists locally keeps the
+// lowest of the two token counts
+static void cli_calmdown_import(struct cli *cli, const char * const *av, void *priv) {
+  snapshotRecord *records, *sorted;
+  unsigned char *merged;
+  unsigned int count, first, last, i, used = 0, imported = 0;
+  bucketSlab *slab;
+  double now = VTIM_real();
+  (void) priv;
+
+  if (readSnapshot(av[2], &records, &count) != 0) {
+    VCLI_Out(cli, "cannot read %s\n", av[2]);
+    VCLI_SetResult(cli, CLIS_CANT);
+    return;
+  }
+
+  // drop records that can not be refilled or collected. a last access in the
+  // future (clock skew between the nodes) would stop both until then: use now
+  for (i = 0, first = 0; i < count; i++) {
+    if (!isfinite(records[i].ratio) || records[i].ratio <= 0 || !isfinite(records[i].capacity) || records[i].capacity <= 0)
+      continue;
+    if (!isfinite(records[i].tokens) || records[i].tokens > records[i].ratio || !isfinite(records[i].lastAccess))
+      continue;
+    if (records[i].lastAccess > now)
+      records[i].lastAccess = now;
+    records[first++] = records[i];
+  }
+  count = first;
+
+  sorted = sort_snapshot(records, count);
+  if (sorted == NULL) {
+    free(records);
+    VCLI_Out(cli, "out of memory\n");
+    VCLI_SetResult(cli, CLIS_CANT);
+    return;
+  }
+  records = sorted;
+
+  // duplicated digests are side by side: keep the record with the fewest tokens,
+  // a digest must match at most one record in the merge below
+  for (i = 0, first = 0; i < count; i++) {
+    if (first > 0 && memcmp(records[i].digest, records[first - 1].digest, DIGEST_LEN) == 0) {
+      if (snapshot_tokens(&records[i], now) < snapshot_tokens(&records[first - 1], now))
+        records[first - 1] = records[i];
+      continue;
+    }
+    records[first++] = records[i];
+  }
+  count = first;
+
+  merged = (unsigned char *)calloc(count + 1, sizeof(unsigned char));
+  slab = allocateBucketSlab(count, DIGEST_LEN);
+  if (merged == NULL || slab == NULL) {
+    free(records);
+    free(merged);
+    free(slab);
+    VCLI_Out(cli, "out of memory\n");
+    VCLI_SetResult(cli, CLIS_CANT);
+    return;
+  }
+
+  AZ(pthread_mutex_lock(&global_initialization_mutex));
+  if (loaded_vcls == 0) {
+    AZ(pthread_mutex_unlock(&global_initialization_mutex));
+    free(records);
+    free(merged);
+    releaseBucketSlab(slab);
+    VCLI_Out(cli, "no VCL is using the module\n");
+    VCLI_SetResult(cli, CLIS_CANT);
+    return;
+  }
+
+  growPartitions(count / SNAPSHOT_BUCKETS_PER_PARTITION);
+
+  for (first = 0; first < count; first = last) {
+    bucketList *v = lockPartition(records[first].digest);
+    bucket *b;
+
+    // the records owned by this partition follow
+    for (last = first + 1; last < count && ownsDigest(v, records[last].digest); last++)
+      ;
+
+    // existing buckets: merge
+    for (b = v->listHead; b != NULL; b = b->nextBucket) {
+      snapshotRecord *r = (snapshotRecord *)bsearch(b->objectDigest, records + first, last - first, sizeof(snapshotRecord), compare_snapshot_key);
+      double tokens;
+
+      if (r == NULL)
+        continue;
+      merged[r - records] = 1;
+      calc_tokens(b, now);
+      tokens = snapshot_tokens(r, now);
+      if (tokens < b->tokens)
+        b->tokens = tokens;
+    }
+
+    // new buckets: prepend
+    for (i = first; i < last; i++) {
+      if (merged[i])
+        continue;
+
+      b = initSlabBucket(slab, used++, records[i].digest, records[i].ratio, records[i].capacity);
+      b->tokens = records[i].tokens;
+      b->lastAccess = records[i].lastAccess;
+      v->listHead = addBucket(b, v->listHead);
+      v->buckets++;
+      imported++;
+    }
+
+    unlockPartition(v);
+  }
+  AZ(pthread_mutex_unlock(&global_initialization_mutex));
+
+  // the unused tail of the slab is released with its last bucket
+  releaseBucketSlab(slab);
+  free(records);
+  free(merged);
+
+  VCLI_Out(cli, "%u buckets imported, %u merged, %u partitions\n", imported, count - imported, partitionCount());
+}
+
+static const struct cli_cmd_desc cli_calmdown_export_desc = {
+  .request = "calmdown.export",
+  .syntax = "calmdown.export <file>",
+  .help = "\tWrite the state of all the live buckets to file.",
+  .minarg = 1,
+  .maxarg = 1
+};
+
+static const struct cli_cmd_desc cli_calmdown_import_desc = {
+  .request = "calmdown.import",
+  .syntax = "calmdown.import <file>",
+  .help = "\tLoad the buckets written by calmdown.export.",
+  .minarg = 1,
+  .maxarg = 1
+};
+
+static struct cli_proto calmdown_cli_cmds[] = {
+  { .desc = &cli_calmdown_top_desc, .func = cli_calmdown_top },
+  { .desc = &cli_calmdown_stats_desc, .func = cli_calmdown_stats },
+  { .desc = &cli_calmdown_export_desc, .func = cli_calmdown_export },
+  { .desc = &cli_calmdown_import_desc, .func = cli_calmdown_import },
+  { .desc = NULL }
+};
+
+// the CLI table keeps pointers to our commands and there is no way to remove
+// them: keep the shared object mapped (and our statics, cli_registered included)
+// after the last VCL importing it is discarded, by holding a reference of our own
+static int pin_module(void) {
+  Dl_info info;
+
+  if (dladdr((void *)pin_module, &info) == 0 || info.dli_fname == NULL)
+    return -1;
+  if (dlopen(info.dli_fname, RTLD_NOW | RTLD_NODELETE) == NULL) {
     #ifdef DEBUG_BUCKETQUEUE
-      printf("vmod_calmdown.c: calmdown(): GC END: %d requests done, %d more to trigger Garbage Collection.\n", v->gc_count, global_opts.gc_interval - v->gc_count);
+      printf("vmod_calmdown.c: pin_module(): %s, varnishadm commands disabled\n", dlerror());
     #endif
+    return -1;
   }
 
-  // free resources
-  if (compound_requester != NULL)
-      free(compound_requester);
-
-  // unlock queue mutex
-  AZ(pthread_mutex_unlock(&v->list_mutex));
-  return (ret);
+  return 0;
 }
 
 // module unload cleanup function
 static void calmdown_deinit(struct vmod_priv *priv) {
-  assert(priv->priv == &need_init);
+  (void) priv;
 
   // lock global init mutex
   #ifdef DEBUG_BUCKETQUEUE
@@ -238,72 +950,103 @@ static void calmdown_deinit(struct vmod_priv *priv) {
   #endif
 
   AZ(pthread_mutex_lock(&global_initialization_mutex));
-  assert(need_init > 0);
+  assert(loaded_vcls > 0);
+
+  // free resources with the last VCL
+  if (--loaded_vcls == 0) {
+    // stop exchanging deltas before the buckets go away
+    stopClusterSync();
+    sync_enabled = FALSE;
 
-  need_init = FALSE;
-  // free resources
-  if (need_init == 0) {
-    unsigned p;
     // free bucket lists
-    for (p = 0; p < global_opts.partitions; p++ ) {
-      bucketList *v = get_bucket(p);
-      #ifdef DEBUG_BUCKETQUEUE
-        printf("vmod_calmdown.c: calmdown_deinit(): Freeing Bucket Queue address 0x%X...\n", v->listHead);
-      #endif
-      freeBucketQueue(v->listHead);
-    }
-    // free buckets
-    free(buckets);
+    freePartitions();
+    freeSessionCache();
+    freeAllowlist(&exempt);
+    free_yaml_options(&global_opts);
   }
 
   // unlock global init mutex
   AZ(pthread_mutex_unlock(&global_initialization_mutex));
 }
 
-// initialization function
+// initialization function.
+// the first VCL reads the configuration and allocates the buckets, the next
+// ones (reloads) share them: limiter state survives a VCL reload
 static int calmdown_prepare(struct vmod_priv *priv) {
-  priv->priv = &need_init;
-  priv->free = calmdown_deinit;
+  const char *cfgfile;
+  (void) priv;
 
   // lock global init mutex
   AZ(pthread_mutex_lock(&global_initialization_mutex));
 
-  // open configuration file...
-  yaml_config_file_descriptor = load_yaml_file(CFGFILE);
-  if (yaml_config_file_descriptor != NULL) {
-    parse_yaml_file(yaml_config_file_descriptor);
-  } else {
-    #ifdef DEBUG_BUCKETQUEUE
-      printf("vmod_calmdown.c: calmdown_prepare(): Failed to open config file, fallback to defaults...\n");
-    #endif
+  // allocate buckets and init mutexes
+  if (loaded_vcls == 0) {
+    // defaults, overridden by the configuration file
+    free_yaml_options(&global_opts);
     global_opts.gc_interval = 100;
     global_opts.partitions = 1;
-  }
+    global_opts.topk_size = HH_DEFAULT_SIZE;
+    global_opts.session_cache = 0;
 
-  // allocate buckets and init mutexes
-  if (need_init == TRUE) {
-    int p;
+    // open configuration file...
+    cfgfile = getenv(CFGFILE_ENV);
+    if (cfgfile == NULL)
+      cfgfile = CFGFILE;
+    yaml_config_file_descriptor = load_yaml_file(cfgfile);
+    if (yaml_config_file_descriptor != NULL) {
+      parse_yaml_file(yaml_config_file_descriptor);
+      // close yaml file descriptor
+      close_yaml_file(yaml_config_file_descriptor);
+    } else {
+      #ifdef DEBUG_BUCKETQUEUE
+        printf("vmod_calmdown.c: calmdown_prepare(): Failed to open config file, fallback to defaults...\n");
+      #endif
+    }
 
     #ifdef DEBUG_BUCKETQUEUE
       printf("vmod_calmdown.c: calmdown_prepare(): Allocating space for %d bucket lists...\n", global_opts.partitions);
     #endif
 
-    buckets = (bucketList *)malloc(global_opts.partitions * sizeof(struct __bucketList));
+    // partitions is only the initial count: contended partitions are split at runtime
+    if (initPartitions(global_opts.partitions, global_opts.topk_size) != 0) {
+      #ifdef DEBUG_BUCKETQUEUE
+        printf("vmod_calmdown.c: calmdown_prepare(): Failed to allocate the bucket lists...\n");
+      #endif
+      free_yaml_options(&global_opts);
+      AZ(pthread_mutex_unlock(&global_initialization_mutex));
+      return (1);
+    }
 
-    for (p = 0; p < global_opts.partitions; p++) {
-      AZ(pthread_mutex_init(&(get_bucket(p)->list_mutex), NULL));
+    // remember the last bucket of each client session
+    if (initSessionCache(global_opts.session_cache) != 0) {
       #ifdef DEBUG_BUCKETQUEUE
-        printf("vmod_calmdown.c: calmdown_prepare(): Allocating Bucket Queue Slice %d...\n", p);
+        printf("vmod_calmdown.c: calmdown_prepare(): Failed to allocate the session cache, disabled...\n");
       #endif
-      get_bucket(p)->listHead = NULL;
-      get_bucket(p)->gc_count = 0;
     }
-  }
-  need_init = FALSE;
 
-  // close yaml file descriptor
-  if (yaml_config_file_descriptor != NULL)
-    close_yaml_file(yaml_config_file_descriptor);
+    // compile the allowlist
+    if (buildAllowlist(&exempt, global_opts.allowlist.items, global_opts.allowlist.count) != 0) {
+      #ifdef DEBUG_BUCKETQUEUE
+        printf("vmod_calmdown.c: calmdown_prepare(): Failed to compile the allowlist, exact keys ignored...\n");
+      #endif
+    }
+
+    // register varnishadm commands (once, they outlive VCL reloads)
+    if (cli_registered == FALSE && pin_module() == 0) {
+      CLI_AddFuncs(calmdown_cli_cmds);
+      cli_registered = TRUE;
+    }
+
+    // start exchanging deltas with the other nodes, if any
+    if (global_opts.sync_peers.count > 0) {
+      #ifdef DEBUG_BUCKETQUEUE
+        printf("vmod_calmdown.c: calmdown_prepare(): Starting cluster sync with %d peers...\n", global_opts.sync_peers.count);
+      #endif
+      if (startClusterSync(global_opts.sync_listen, global_opts.sync_peers.items, global_opts.sync_peers.count, global_opts.sync_interval, sync_collect, sync_merge) == 0)
+        sync_enabled = TRUE;
+    }
+  }
+  loaded_vcls++;
 
   // unlock global init mutex
   AZ(pthread_mutex_unlock(&global_initialization_mutex));
@@ -312,8 +1055,6 @@ static int calmdown_prepare(struct vmod_priv *priv) {
 
 // module load init function
 int calmdown_init(const struct vrt_ctx *ctx, struct vmod_priv *priv, enum vcl_event_e e) {
-  (void) ctx;
-  (void) priv;
   // implement event callbacks:
   switch(e) {
     case VCL_EVENT_LOAD:
@@ -321,15 +1062,19 @@ int calmdown_init(const struct vrt_ctx *ctx, struct vmod_priv *priv, enum vcl_ev
         printf("vmod_calmdown.c: calmdown_init(): Handling VCL_EVENT_LOAD.");
       #endif
 
-      calmdown_prepare(priv);
-      break;
+      // the VCL fails to load if the bucket lists can not be allocated
+      if (calmdown_prepare(priv) != 0) {
+        VSB_printf(ctx->msg, "calmdown: cannot allocate the bucket lists\n");
+        return (1);
+      }
+      return (0);
     case VCL_EVENT_DISCARD:
       #ifdef DEBUG_BUCKETQUEUE
         printf("vmod_calmdown.c: calmdown_init(): Handling VCL_EVENT_DISCARD.");
       #endif
 
       calmdown_deinit(priv);
-      break;
+      return (0);
     default:
       #ifdef DEBUG_BUCKETQUEUE
         printf("vmod_calmdown.c: calmdown_init(): default event.");
@@ -337,5 +1082,3 @@ int calmdown_init(const struct vrt_ctx *ctx, struct vmod_priv *priv, enum vcl_ev
       return(0);
   }
 }
-
-
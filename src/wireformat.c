@@ -0,0 +1,55 @@
+/*
+ *   Wire Format.
+ *   Network-order encoding of the numbers written by snapshots and cluster sync
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "wireformat.h"
+
+// store a double as a network-order 64 bit float
+void putDouble(unsigned char *p, double value) {
+  uint64_t u;
+  uint32_t half;
+
+  memcpy(&u, &value, sizeof(u));
+  half = htonl((uint32_t)(u >> 32));
+  memcpy(p, &half, sizeof(half));
+  half = htonl((uint32_t)u);
+  memcpy(p + 4, &half, sizeof(half));
+}
+
+// read a network-order 64 bit float
+double getDouble(const unsigned char *p) {
+  double value;
+  uint64_t u;
+  uint32_t hi, lo;
+
+  memcpy(&hi, p, sizeof(hi));
+  memcpy(&lo, p + 4, sizeof(lo));
+  u = (uint64_t)ntohl(hi) << 32 | ntohl(lo);
+  memcpy(&value, &u, sizeof(value));
+  return value;
+}
+
+// store a double as a network-order 32 bit float
+void putFloat(unsigned char *p, double value) {
+  float f = (float)value;
+  uint32_t u;
+
+  memcpy(&u, &f, sizeof(u));
+  u = htonl(u);
+  memcpy(p, &u, sizeof(u));
+}
+
+// read a network-order 32 bit float
+double getFloat(const unsigned char *p) {
+  float f;
+  uint32_t u;
+
+  memcpy(&u, p, sizeof(u));
+  u = ntohl(u);
+  memcpy(&f, &u, sizeof(f));
+  return ((double)f);
+}
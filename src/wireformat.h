@@ -0,0 +1,23 @@
+/*
+ *   Wire Format.
+ *   Network-order encoding of the numbers written by snapshots and cluster sync
+ */
+
+// libc includes
+#include <stdint.h>
+
+/*
+ * Function prototypes.
+ */
+
+// store a double as a network-order 64 bit float
+void putDouble(unsigned char *p, double value);
+
+// read a network-order 64 bit float
+double getDouble(const unsigned char *p);
+
+// store a double as a network-order 32 bit float (bucket parameters)
+void putFloat(unsigned char *p, double value);
+
+// read a network-order 32 bit float
+double getFloat(const unsigned char *p);
@@ -18,11 +18,27 @@ FILE *load_yaml_file(const char *filename) {
   return yaml_file;
 }
 
+// append a copy of value to a string list
+static void append_string_list(slist *list, const char *value) {
+  char **items;
+
+  items = (char **)realloc(list->items, (list->count + 1) * sizeof(char *));
+  if (items == NULL)
+    return;
+
+  list->items = items;
+  list->items[list->count] = strdup(value);
+  if (list->items[list->count] != NULL)
+    list->count++;
+}
+
 // parse yaml file..
 int parse_yaml_file(FILE *handle) {
   // parser state
   unsigned int state = PARSE_EXPECT_ID;
   unsigned int *data_pointer = NULL;
+  char **string_pointer = NULL;
+  slist *list_pointer = NULL;
 
   // initialize yaml parser
   if (!yaml_parser_initialize(&main_parser)) {
@@ -72,11 +88,25 @@ int parse_yaml_file(FILE *handle) {
         #ifdef DEBUG_PARSER
           printf("yamlparser.c :: parse_yaml_file(): --> Start of a Sequence\n");
         #endif
+        // a sequence is the value of the last key: collect its items
+        if (state == PARSE_EXPECT_VALUE) {
+          #ifdef DEBUG_PARSER
+            printf("yamlparser.c :: parse_yaml_file(): ----> Switching state to PARSE_EXPECT_LIST_ITEM\n");
+          #endif
+          state = PARSE_EXPECT_LIST_ITEM;
+        }
         break;
       case YAML_SEQUENCE_END_EVENT:
         #ifdef DEBUG_PARSER
           printf("yamlparser.c :: parse_yaml_file(): --> End of a Sequence\n");
         #endif
+        if (state == PARSE_EXPECT_LIST_ITEM) {
+          #ifdef DEBUG_PARSER
+            printf("yamlparser.c :: parse_yaml_file(): ----> Switching state to PARSE_EXPECT_ID\n");
+          #endif
+          list_pointer = NULL;
+          state = PARSE_EXPECT_ID;
+        }
         break;
       case YAML_MAPPING_START_EVENT:
         #ifdef DEBUG_PARSER
@@ -97,7 +127,17 @@ int parse_yaml_file(FILE *handle) {
         #ifdef DEBUG_PARSER
           printf("yamlparser.c :: parse_yaml_file(): ---> Scalar Event (value %s)\n", pevent.data.scalar.value);
         #endif
-        if (state == PARSE_EXPECT_ID) {
+        if (state == PARSE_EXPECT_LIST_ITEM) {
+          if (list_pointer != NULL) {
+            #ifdef DEBUG_PARSER
+              printf("yamlparser.c :: parse_yaml_file(): Appending value %s to list at address 0x%X...\n", pevent.data.scalar.value, list_pointer);
+            #endif
+            append_string_list(list_pointer, (const char *)pevent.data.scalar.value);
+          }
+        } else if (state == PARSE_EXPECT_ID) {
+          data_pointer = NULL;
+          string_pointer = NULL;
+          list_pointer = NULL;
           if (strncmp(pevent.data.scalar.value, "gc_interval", strlen("gc_interval")) == 0) {
             #ifdef DEBUG_PARSER
               printf("yamlparser.c :: parse_yaml_file(): ----> Selecting structure member at address 0x%X\n", &(global_opts.gc_interval));
@@ -108,7 +148,37 @@ int parse_yaml_file(FILE *handle) {
               printf("yamlparser.c :: parse_yaml_file(): ----> Selecting structure member at address 0x%X\n", &(global_opts.partitions));
             #endif
             data_pointer = &(global_opts.partitions);
-          } else data_pointer = NULL;
+          } else if (strncmp(pevent.data.scalar.value, "sync_listen", strlen("sync_listen")) == 0) {
+            #ifdef DEBUG_PARSER
+              printf("yamlparser.c :: parse_yaml_file(): ----> Selecting structure member at address 0x%X\n", &(global_opts.sync_listen));
+            #endif
+            string_pointer = &(global_opts.sync_listen);
+          } else if (strncmp(pevent.data.scalar.value, "sync_peers", strlen("sync_peers")) == 0) {
+            #ifdef DEBUG_PARSER
+              printf("yamlparser.c :: parse_yaml_file(): ----> Selecting structure member at address 0x%X\n", &(global_opts.sync_peers));
+            #endif
+            list_pointer = &(global_opts.sync_peers);
+          } else if (strncmp(pevent.data.scalar.value, "sync_interval", strlen("sync_interval")) == 0) {
+            #ifdef DEBUG_PARSER
+              printf("yamlparser.c :: parse_yaml_file(): ----> Selecting structure member at address 0x%X\n", &(global_opts.sync_interval));
+            #endif
+            data_pointer = &(global_opts.sync_interval);
+          } else if (strncmp(pevent.data.scalar.value, "topk_size", strlen("topk_size")) == 0) {
+            #ifdef DEBUG_PARSER
+              printf("yamlparser.c :: parse_yaml_file(): ----> Selecting structure member at address 0x%X\n", &(global_opts.topk_size));
+            #endif
+            data_pointer = &(global_opts.topk_size);
+          } else if (strncmp(pevent.data.scalar.value, "allowlist", strlen("allowlist")) == 0) {
+            #ifdef DEBUG_PARSER
+              printf("yamlparser.c :: parse_yaml_file(): ----> Selecting structure member at address 0x%X\n", &(global_opts.allowlist));
+            #endif
+            list_pointer = &(global_opts.allowlist);
+          } else if (strncmp(pevent.data.scalar.value, "session_cache", strlen("session_cache")) == 0) {
+            #ifdef DEBUG_PARSER
+              printf("yamlparser.c :: parse_yaml_file(): ----> Selecting structure member at address 0x%X\n", &(global_opts.session_cache));
+            #endif
+            data_pointer = &(global_opts.session_cache);
+          }
           #ifdef DEBUG_PARSER
             printf("yamlparser.c :: parse_yaml_file(): ----> Switching state to PARSE_EXPECT_VALUE\n");
           #endif
@@ -119,6 +189,12 @@ int parse_yaml_file(FILE *handle) {
               printf("yamlparser.c :: parse_yaml_file(): Copying value %d to address 0x%X...\n", atoi(pevent.data.scalar.value), data_pointer);
             #endif
             *data_pointer = atoi(pevent.data.scalar.value);
+          } else if (string_pointer != NULL) {
+            #ifdef DEBUG_PARSER
+              printf("yamlparser.c :: parse_yaml_file(): Copying string %s to address 0x%X...\n", pevent.data.scalar.value, string_pointer);
+            #endif
+            free(*string_pointer);
+            *string_pointer = strdup((const char *)pevent.data.scalar.value);
           }
           #ifdef DEBUG_PARSER
             printf("yamlparser.c :: parse_yaml_file(): ----> Switching state to PARSE_EXPECT_ID\n");
@@ -159,3 +235,22 @@ int close_yaml_file(FILE *handle) {
   } else return 1;
 }
 
+// release strings and lists allocated by the parser
+void free_yaml_options(goptions *opts) {
+  unsigned int i;
+
+  free(opts->sync_listen);
+  opts->sync_listen = NULL;
+
+  for (i = 0; i < opts->sync_peers.count; i++)
+    free(opts->sync_peers.items[i]);
+  free(opts->sync_peers.items);
+  opts->sync_peers.items = NULL;
+  opts->sync_peers.count = 0;
+
+  for (i = 0; i < opts->allowlist.count; i++)
+    free(opts->allowlist.items[i]);
+  free(opts->allowlist.items);
+  opts->allowlist.items = NULL;
+  opts->allowlist.count = 0;
+}
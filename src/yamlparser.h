@@ -4,20 +4,38 @@
 
 // system includes
 #include <stdlib.h>
+#include <string.h>
 #ifdef DEBUG_PARSER
   #include <stdio.h>
 #endif
 #include <yaml.h>
 
+// parsed list of strings (yaml sequences)
+typedef struct __string_list {
+  char **items;
+  unsigned int count;
+} slist;
+
 // global parsed options
 typedef struct __global_options {
   unsigned int gc_interval;
   unsigned int partitions;
+  // cluster sync: local address, peer addresses and flush interval (msec)
+  char *sync_listen;
+  slist sync_peers;
+  unsigned int sync_interval;
+  // keys tracked per partition by the heavy hitters table
+  unsigned int topk_size;
+  // requesters that are never rate limited (exact keys or CIDR networks)
+  slist allowlist;
+  // slots of the per-session bucket cache (0 disables it)
+  unsigned int session_cache;
 } goptions;
 
 enum parse_expect_type {
   PARSE_EXPECT_ID = 0,
-  PARSE_EXPECT_VALUE
+  PARSE_EXPECT_VALUE,
+  PARSE_EXPECT_LIST_ITEM
 };
 
 // main global options
@@ -34,3 +52,6 @@ int parse_yaml_file(FILE *handle);
 
 // close file handle
 int close_yaml_file(FILE *handle);
+
+// release strings and lists allocated by the parser
+void free_yaml_options(goptions *opts);